@@ -18,14 +18,19 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "audiosrc.h"
 #include "convolver.h"
 
 using namespace ZeroConvoLV2;
 
+const float Convolver::SILENCE_POWER = 1e-15f;
+const float Convolver::SPARSE_ERROR  = 1e-8f;
+
 DelayLine::DelayLine ()
 	: _buf (0)
 	, _written (false)
@@ -84,6 +89,101 @@ DelayLine::run (float* buf, uint32_t n_samples)
 	}
 }
 
+PreDelay::PreDelay ()
+	: _buf (0)
+	, _size (0)
+	, _delay (0)
+	, _prev (0)
+	, _fade (0)
+	, _pos (0)
+{
+}
+
+PreDelay::~PreDelay ()
+{
+	free (_buf);
+}
+
+void
+PreDelay::clear ()
+{
+	if (_buf) {
+		memset (_buf, 0, _size * sizeof (float));
+	}
+	_pos  = 0;
+	_fade = 0;
+}
+
+void
+PreDelay::reset (uint32_t capacity, uint32_t delay)
+{
+	free (_buf);
+	_buf   = (float*)malloc ((1 + capacity) * sizeof (float));
+	_size  = _buf ? 1 + capacity : 0;
+	_delay = std::min (delay, this->capacity ());
+	/* also pre-faults the buffer */
+	clear ();
+}
+
+bool
+PreDelay::set_delay (uint32_t delay)
+{
+	if (delay > capacity ()) {
+		return false;
+	}
+	if (delay != _delay) {
+		/* a change during a fade continues from the previous target */
+		_prev  = _delay;
+		_delay = delay;
+		_fade  = FADE_LEN;
+	}
+	return true;
+}
+
+void
+PreDelay::run (float* dst, float const* src, uint32_t n_samples)
+{
+	if (!_buf) {
+		memcpy (dst, src, n_samples * sizeof (float));
+		return;
+	}
+	/* always written, so that the delay can be increased */
+	const uint32_t d = _delay;
+	uint32_t       r = _pos >= d ? _pos - d : _pos + _size - d;
+	uint32_t       i = 0;
+
+	if (_fade > 0) {
+		/* read both taps, and fade from the old to the new one */
+		const uint32_t p = _prev;
+		uint32_t       q = _pos >= p ? _pos - p : _pos + _size - p;
+		for (; i < n_samples && _fade > 0; ++i, --_fade) {
+			const float g = _fade / (float)FADE_LEN;
+			_buf[_pos]    = src[i];
+			dst[i]        = g * _buf[q] + (1.f - g) * _buf[r];
+			if (++_pos == _size) {
+				_pos = 0;
+			}
+			if (++r == _size) {
+				r = 0;
+			}
+			if (++q == _size) {
+				q = 0;
+			}
+		}
+	}
+
+	for (; i < n_samples; ++i) {
+		_buf[_pos] = src[i];
+		dst[i]     = _buf[r];
+		if (++_pos == _size) {
+			_pos = 0;
+		}
+		if (++r == _size) {
+			r = 0;
+		}
+	}
+}
+
 TimeDomainConvolver::TimeDomainConvolver ()
 {
 	reset ();
@@ -103,7 +203,7 @@ TimeDomainConvolver::configure (Readable* r, float gain, uint32_t delay)
 	if (delay >= ir_len) {
 		return;
 	}
-	uint32_t to_read = std::min (ir_len, delay);
+	uint32_t to_read = ir_len - delay;
 	uint32_t max_len = r->readable_length ();
 	if (delay < max_len) {
 		to_read = std::min (to_read, max_len - delay);
@@ -112,12 +212,12 @@ TimeDomainConvolver::configure (Readable* r, float gain, uint32_t delay)
 		return;
 	}
 
-	r->read (&_ir[delay], 0, to_read, 0);
+	/* add, several IR channels may share an input with summed inputs */
+	float ir[sizeof (_ir) / sizeof (float)];
+	r->read (ir, 0, to_read, 0);
 
-	if (gain != 1.f) {
-		for (uint32_t i = delay; i < ir_len; ++i) {
-			_ir[i] *= gain;
-		}
+	for (uint32_t i = 0; i < to_read; ++i) {
+		_ir[delay + i] += gain * ir[i];
 	}
 	_enabled = true;
 }
@@ -135,14 +235,212 @@ TimeDomainConvolver::run (float* out, float const* in, uint32_t n_samples) const
 	}
 }
 
+MultiRateFilter::MultiRateFilter ()
+	: _ratio (1)
+{
+}
+
+void
+MultiRateFilter::configure (uint32_t ratio, uint32_t sample_rate, uint32_t max_block)
+{
+	const double fn = sample_rate / (2.0 * ratio);   // Nyquist frequency at the low rate
+	const double fp = std::min (20000.0, 0.9 * fn);  // passband edge
+	const double fc = 0.5 / ratio;                   // normalized cutoff
+
+	/* Blackman window, the transition band is about 5.5 / N wide and
+	 * may extend to (2 * fn - fp). Aliases of this band are above fp. */
+	uint32_t n = ceil (5.5 * sample_rate / (2.0 * (fn - fp)));
+	/* odd length, the group-delay is a multiple of the ratio */
+	n = 2 * ratio * ((n + 2 * ratio - 2) / (2 * ratio)) + 1;
+
+	_ratio = ratio;
+	_h.resize (n);
+
+	double sum = 0;
+	for (uint32_t k = 0; k < n; ++k) {
+		const double x = k - (n - 1) / 2.0;
+		const double w = 0.42 - 0.5 * cos (2 * M_PI * k / (n - 1)) + 0.08 * cos (4 * M_PI * k / (n - 1));
+		_h[k] = w * (x == 0 ? 2 * fc : sin (2 * M_PI * fc * x) / (M_PI * x));
+		sum += _h[k];
+	}
+	for (uint32_t k = 0; k < n; ++k) {
+		_h[k] /= sum;
+	}
+
+	/* polyphase components for interpolation, in reverse order
+	 * and scaled by the ratio */
+	const uint32_t len = (n - 1) / ratio + 1;
+	_poly.assign (ratio * len, 0.f);
+	for (uint32_t p = 0; p < ratio; ++p) {
+		for (uint32_t i = 0; p + i * ratio < n; ++i) {
+			_poly[p * len + len - 1 - i] = ratio * _h[p + i * ratio];
+		}
+	}
+
+	_z.resize (n - 1 + max_block);
+	clear ();
+}
+
+void
+MultiRateFilter::clear ()
+{
+	std::fill (_z.begin (), _z.end (), 0.f);
+}
+
+void
+MultiRateFilter::decimate (float const* in, float* out, uint32_t n_samples)
+{
+	const uint32_t n_taps = _h.size ();
+	const uint32_t hist   = n_taps - 1;
+
+	assert (hist + n_samples <= _z.size ());
+	memcpy (&_z[hist], in, n_samples * sizeof (float));
+
+	/* the filter is symmetric */
+	for (uint32_t j = 0; j < n_samples / _ratio; ++j) {
+		float const* z = &_z[j * _ratio];
+		float        y = 0;
+		for (uint32_t k = 0; k < n_taps; ++k) {
+			y += _h[k] * z[k];
+		}
+		out[j] = y;
+	}
+
+	memmove (&_z[0], &_z[n_samples], hist * sizeof (float));
+}
+
+void
+MultiRateFilter::interpolate (float const* in, float* out, uint32_t n_samples)
+{
+	const uint32_t len  = _poly.size () / _ratio;
+	const uint32_t hist = len - 1;
+	const uint32_t n_in = n_samples / _ratio;
+
+	assert (hist + n_in <= _z.size ());
+	memcpy (&_z[hist], in, n_in * sizeof (float));
+
+	for (uint32_t j = 0; j < n_in; ++j) {
+		for (uint32_t p = 0; p < _ratio; ++p) {
+			float const* h = &_poly[p * len];
+			float const* z = &_z[j];
+			float        y = 0;
+			for (uint32_t i = 0; i < len; ++i) {
+				y += h[i] * z[i];
+			}
+			out[j * _ratio + p] += y;
+		}
+	}
+
+	memmove (&_z[0], &_z[n_in], hist * sizeof (float));
+}
+
+void
+MultiRateFilter::downsample (float const* in, uint32_t len, uint32_t offset, std::vector<float>& out) const
+{
+	const int32_t n_taps = _h.size ();
+	const int32_t delay  = (n_taps - 1) / 2;
+	const int32_t n_out  = (len + delay + offset) / _ratio + 1;
+
+	out.resize (n_out);
+
+	for (int32_t i = 0; i < n_out; ++i) {
+		const int32_t c = i * _ratio - offset + delay;
+		double        y = 0;
+		for (int32_t k = std::max (0, c - (int32_t)len + 1); k < n_taps && k <= c; ++k) {
+			y += _h[k] * in[c - k];
+		}
+		out[i] = _ratio * y;
+	}
+}
+
+/* Look up a measured partition layout, as written by `zconvo-tune`.
+ *
+ * The table is read from $ZCONVOLV_LAYOUT or
+ * $XDG_CONFIG_HOME/zconvolv/layout.conf (~/.config/zconvolv/layout.conf).
+ * Each line holds
+ *   ninp nout npaths quantum irlen ncores minpart maxpart density
+ * The row with the smallest irlen >= length that matches all other
+ * parameters is used. ncores 0 matches any machine.
+ * Only zero latency layouts (minpart == quantum) are considered.
+ */
+static bool
+lookup_layout (uint32_t ninp, uint32_t nout, uint32_t npaths, uint32_t quantum, uint32_t length, uint32_t& maxpart, float& density)
+{
+	char        fn[1024];
+	const char* env = getenv ("ZCONVOLV_LAYOUT");
+
+	if (env) {
+		snprintf (fn, sizeof (fn), "%s", env);
+	} else if ((env = getenv ("XDG_CONFIG_HOME"))) {
+		snprintf (fn, sizeof (fn), "%s/zconvolv/layout.conf", env);
+	} else if ((env = getenv ("HOME"))) {
+		snprintf (fn, sizeof (fn), "%s/.config/zconvolv/layout.conf", env);
+	} else {
+		return false;
+	}
+
+	FILE* f = fopen (fn, "r");
+	if (!f) {
+		return false;
+	}
+
+#ifdef _WIN32
+	const uint32_t ncores = 0;
+#else
+	const uint32_t ncores = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+	uint32_t best = 0;
+	char     line[256];
+
+	while (fgets (line, sizeof (line), f)) {
+		uint32_t ni, no, np, qt, len, nc, mnp, mxp;
+		float    dns;
+		if (line[0] == '#') {
+			continue;
+		}
+		if (9 != sscanf (line, "%u %u %u %u %u %u %u %u %f", &ni, &no, &np, &qt, &len, &nc, &mnp, &mxp, &dns)) {
+			continue;
+		}
+		if (ni != ninp || no != nout || np != npaths || qt != quantum || mnp != quantum) {
+			continue;
+		}
+		if (nc != 0 && nc != ncores) {
+			continue;
+		}
+		if (len < length || (best > 0 && len >= best)) {
+			continue;
+		}
+		if (mxp < mnp || mxp > Convproc::MAXPART || (mxp & (mxp - 1))) {
+			continue;
+		}
+		best    = len;
+		maxpart = mxp;
+		density = dns;
+	}
+
+	fclose (f);
+
+#ifndef NDEBUG
+	if (best > 0) {
+		printf ("Convolver: using measured layout from '%s': maxpart=%d density=%.2f\n", fn, maxpart, density);
+	}
+#endif
+	return best > 0;
+}
+
 Convolver::Convolver (std::string const& path,
                       uint32_t           sample_rate,
                       int                sched_policy,
                       int                sched_priority,
                       IRChannelConfig    irc,
-                      IRSettings         irs)
+                      IRSettings         irs,
+                      uint32_t           n_inputs,
+                      uint32_t           n_outputs)
 	: _path (path)
 	, _irc (irc)
+	, _n_in (std::max (1u, std::min (n_inputs, (uint32_t)MAXCHN)))
+	, _n_out (std::max (1u, std::min (n_outputs, (uint32_t)MAXCHN)))
 	, _sched_policy (sched_policy)
 	, _sched_priority (sched_priority)
 	, _period_ns (2e6)
@@ -150,9 +448,16 @@ Convolver::Convolver (std::string const& path,
 	, _samplerate (sample_rate)
 	, _n_samples (0)
 	, _max_size (0)
+	, _tail_ratio (1)
+	, _tail_quantum (0)
+	, _tail_pos (0)
 	, _offset (0)
 	, _artificial_latency (0)
+	, _late (0)
 	, _configured (false)
+	, _enabled (true)
+	, _freewheel (false)
+	, _suspend (Active)
 	, _dry (0.f)
 	, _wet (1.f)
 	, _dry_target (0.f)
@@ -165,7 +470,7 @@ Convolver::Convolver (std::string const& path,
 		_fs = new FileSource (_path);
 	}
 
-	if (_fs->readable_length () > 0x1000000 /*2^24*/) {
+	if (_fs->readable_length () > 0x4000000 /*2^26*/) {
 		delete _fs;
 		_fs = 0;
 		throw std::runtime_error ("Convolver: IR file too long.");
@@ -191,7 +496,18 @@ Convolver::Convolver (std::string const& path,
 		throw std::runtime_error ("Convolver: no usable audio-channels.");
 	}
 
+	if (!channel_settings_ok (_ir_settings)) {
+		for (std::vector<Readable*>::const_iterator i = _readables.begin (); i != _readables.end (); ++i) {
+			delete *i;
+		}
+		delete _fs;
+		throw std::runtime_error ("Convolver: channel gain and delay are not supported for more than 4 IR channels.");
+	}
+
 	_artificial_latency = _ir_settings.artificial_latency * _readables[0]->resample_ratio ();
+
+	analyze_ir ();
+	find_linked_channels ();
 }
 
 Convolver::~Convolver ()
@@ -203,14 +519,285 @@ Convolver::~Convolver ()
 	delete _fs;
 }
 
+/* Find the audible part of each IR channel.
+ *
+ * Leading and trailing samples below `trim_threshold` dB relative to the
+ * peak of all channels are not convolved. Leading silence is retained as
+ * offset, so that partitions before the first audible sample remain empty.
+ * The resolution is 64 samples (Convproc::MINPART).
+ */
+void
+Convolver::analyze_ir ()
+{
+	const uint32_t len   = ir_length ();
+	const uint32_t n_chn = _readables.size ();
+	const uint32_t blksz = Convproc::MINPART;
+
+	_ir_start.assign (n_chn, 0);
+	_ir_end.assign (n_chn, len);
+
+	if (_ir_settings.trim_threshold >= 0) {
+		return;
+	}
+
+	/* peak per block */
+	std::vector<std::vector<float> > env (n_chn);
+	float                            peak = 0;
+
+	for (uint32_t c = 0; c < n_chn; ++c) {
+		Readable* r   = _readables[c];
+		uint32_t  pos = 0;
+
+		env[c].reserve ((len + blksz - 1) / blksz);
+
+		while (pos < len) {
+			float ir[8192];
+
+			uint64_t ns = r->read (ir, pos, std::min ((uint32_t)8192, len - pos), 0);
+			if (ns == 0) {
+				break;
+			}
+			for (uint64_t i = 0; i < ns; i += blksz) {
+				float pk = 0;
+				for (uint64_t j = i; j < std::min (ns, i + blksz); ++j) {
+					pk = std::max (pk, fabsf (ir[j]));
+				}
+				env[c].push_back (pk);
+				peak = std::max (peak, pk);
+			}
+			pos += ns;
+		}
+	}
+
+	if (peak == 0) {
+		return;
+	}
+
+	const float thresh = peak * powf (10.f, .05f * _ir_settings.trim_threshold);
+
+	for (uint32_t c = 0; c < n_chn; ++c) {
+		uint32_t first = env[c].size ();
+		uint32_t last  = 0;
+		for (uint32_t b = 0; b < env[c].size (); ++b) {
+			if (env[c][b] > thresh) {
+				first = std::min (first, b);
+				last  = b + 1;
+			}
+		}
+		if (last == 0) {
+			/* silent channel */
+			_ir_start[c] = _ir_end[c] = 0;
+		} else {
+			_ir_start[c] = first * blksz;
+			_ir_end[c]   = std::min (len, last * blksz);
+		}
+	}
+}
+
+/* Test if y = gain * x may hold for a window of the IR,
+ * with the same residual as proportional () */
+static bool
+similar (float const* x, float const* y, uint32_t n)
+{
+	double sxx = 0;
+	double sxy = 0;
+	double syy = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		sxx += x[i] * x[i];
+		sxy += x[i] * y[i];
+		syy += y[i] * y[i];
+	}
+	if (sxx == 0 || syy == 0) {
+		/* silent in both is inconclusive */
+		return sxx == syy;
+	}
+	return syy - sxy * sxy / sxx <= 1e-12 * syy;
+}
+
+/* Test if b = gain * a, with a residual below -120 dB */
+static bool
+proportional (Readable* a, Readable* b, uint32_t len, float& gain)
+{
+	double   sxx = 0;
+	double   sxy = 0;
+	double   syy = 0;
+	uint32_t pos = 0;
+
+	while (pos < len) {
+		float x[8192];
+		float y[8192];
+
+		const uint32_t n = std::min ((uint32_t)8192, len - pos);
+		if (a->read (x, pos, n, 0) != n || b->read (y, pos, n, 0) != n) {
+			return false;
+		}
+		for (uint32_t i = 0; i < n; ++i) {
+			sxx += x[i] * x[i];
+			sxy += x[i] * y[i];
+			syy += y[i] * y[i];
+		}
+		/* least-squares residual */
+		if (syy > 0 && (sxx == 0 || syy - sxy * sxy / sxx > 1e-12 * syy)) {
+			return false;
+		}
+		pos += n;
+	}
+	if (sxx == 0 || syy == 0) {
+		return false;
+	}
+	gain = sxy / sxx;
+	return true;
+}
+
+/* Find IR channels that are identical to an earlier one, up to a gain.
+ * Paths using them share the spectra of that channel, see
+ * Convproc::impdata_link(). This is common for 4 channel files made
+ * from a stereo IR, and silent channels are ignored.
+ */
+void
+Convolver::find_linked_channels ()
+{
+	const uint32_t len   = ir_length ();
+	const uint32_t n_chn = _readables.size ();
+
+	_ir_root.resize (n_chn);
+	_ir_scale.assign (n_chn, 1.f);
+
+	/* Read a window at the start of the audible part of each channel
+	 * once, and compare the complete channels only if their windows
+	 * are proportional. A matrix IR has n_chn^2 / 2 pairs. */
+	const uint32_t win = std::min (len, 2048u);
+	const uint32_t pos = std::min (ir_start (), len - win);
+
+	std::vector<std::vector<float> > head (n_chn);
+	for (uint32_t c = 0; c < n_chn && n_chn > 1; ++c) {
+		if (_ir_end[c] > 0) {
+			head[c].resize (win);
+			if (_readables[c]->read (&head[c][0], pos, win, 0) != win) {
+				head[c].clear ();
+			}
+		}
+	}
+
+	for (uint32_t c = 0; c < n_chn; ++c) {
+		_ir_root[c] = c;
+		for (uint32_t d = 0; d < c && _ir_end[c] > 0; ++d) {
+			float gain;
+			if (_ir_root[d] != d || _ir_end[d] == 0) {
+				continue;
+			}
+			if (head[c].size () == win && head[d].size () == win && !similar (&head[d][0], &head[c][0], win)) {
+				continue;
+			}
+			if (!proportional (_readables[d], _readables[c], len, gain)) {
+				continue;
+			}
+			_ir_root[c]  = d;
+			_ir_scale[c] = gain;
+			/* both need the same audible part, it only differs
+			 * by samples below the trim threshold */
+			_ir_start[d] = _ir_start[c] = std::min (_ir_start[c], _ir_start[d]);
+			_ir_end[d] = _ir_end[c] = std::max (_ir_end[c], _ir_end[d]);
+#ifndef NDEBUG
+			printf ("Convolver: IR channel %d = %.3f * channel %d\n", c + 1, gain, d + 1);
+#endif
+			break;
+		}
+	}
+}
+
+uint32_t
+Convolver::ir_start () const
+{
+	uint32_t s = ir_length ();
+	for (uint32_t c = 0; c < _ir_start.size (); ++c) {
+		if (_ir_end[c] > 0) {
+			s = std::min (s, _ir_start[c]);
+		}
+	}
+	return std::min (s, ir_end ());
+}
+
+uint32_t
+Convolver::ir_end () const
+{
+	uint32_t e = 0;
+	for (uint32_t c = 0; c < _ir_end.size (); ++c) {
+		e = std::max (e, _ir_end[c]);
+	}
+	return e;
+}
+
+/* number of outputs per input in the IR file of the Matrix config */
+uint32_t
+Convolver::matrix_outputs () const
+{
+	if (_ir_settings.matrix_outputs > 0) {
+		return std::min ((uint32_t)_ir_settings.matrix_outputs, _n_out);
+	}
+	return _n_out;
+}
+
+/* engine input of the n-th impulse path */
+int
+Convolver::path_input (uint32_t c, uint32_t n_imp) const
+{
+	if (_irc == Matrix) {
+		/* N * M chan file  1: 1 -> 1, 2: 1 -> 2, .. M + 1: 2 -> 1, .. */
+		return c / matrix_outputs ();
+	} else if (n_imp == 2 && _irc == Stereo) {
+		/*           (imp, in, out)
+		 * Stereo       (2, 2, 2)    1: L -> L, 2: R -> R
+		 */
+		return c % n_inputs ();
+	} else {
+		/*           (imp, in, out)
+		 * Mono         (1, 1, 1)   1: M -> M
+		 * MonoToStereo (2, 1, 2)   1: M -> L, 2: M -> R
+		 * Stereo       (4, 2, 2)   1: L -> L, 2: L -> R, 3: R -> L, 4: R -> R
+		 */
+		return (c / n_outputs ()) % n_inputs ();
+	}
+}
+
+/* engine output of the n-th impulse path */
+int
+Convolver::path_output (uint32_t c) const
+{
+	return c % (_irc == Matrix ? matrix_outputs () : n_outputs ());
+}
+
+/* channel_gain and channel_delay are available for the first 4 IR
+ * channels. Matrix IRs with more channels do not support them, see
+ * channel_settings_ok() */
+static float
+channel_gain (Convolver::IRSettings const& irs, uint32_t c)
+{
+	return c < 4 ? irs.channel_gain[c] : 1.f;
+}
+
+/* total delay of the n-th impulse path, at the engine rate */
+uint32_t
+Convolver::path_delay (IRSettings const& irs, uint32_t c) const
+{
+	const int32_t chan_delay = c < 4 ? irs.channel_delay[c] : 0;
+	return (irs.pre_delay + chan_delay) * _readables[0]->resample_ratio ();
+}
+
 void
-Convolver::reconfigure (uint32_t block_size, bool threaded)
+Convolver::reconfigure (uint32_t block_size, bool threaded, bool start)
 {
 	_convproc.stop_process ();
+	_tail.stop_process ();
 	_convproc.cleanup ();
-	_convproc.set_options (0);
+	_tail.cleanup ();
+	_convproc.set_silence_threshold (SILENCE_POWER);
+	_convproc.set_sparse_threshold (SPARSE_ERROR);
+	_tail.set_silence_threshold (SILENCE_POWER);
+	_tail.set_sparse_threshold (SPARSE_ERROR);
 
 	_period_ns = 1e9 * block_size / _samplerate;
+	_late      = 0;
 
 	assert (!_readables.empty ());
 
@@ -226,17 +813,7 @@ Convolver::reconfigure (uint32_t block_size, bool threaded)
 		n_part     = _n_samples;
 	}
 
-	_offset   = 0;
-	_max_size = _readables[0]->readable_length ();
-
-	int rv = _convproc.configure (
-	    /*in*/  n_inputs (),
-	    /*out*/ n_outputs (),
-	    /*max-convolution length */ _max_size,
-	    /*quantum, nominal-buffersize*/ _n_samples,
-	    /*Convproc::MINPART*/ _n_samples,
-	    /*Convproc::MAXPART*/ n_part,
-	    /*density*/ 0);
+	_offset = 0;
 
 	/* map channels
 	 * - Mono:
@@ -249,11 +826,21 @@ Convolver::reconfigure (uint32_t block_size, bool threaded)
 	 *    stereo-file: L -> L, R -> R  -- no L/R, R/L x-over
 	 *    3chan-file: ignore 3rd channel, use as stereo-file.
 	 *    4chan file:  L -> L, L -> R, R -> L, R -> R
+	 * - Stereo with summed inputs:
+	 *    as above, using a single engine input. IR channels for the
+	 *    same output are added, (L -> L) + (R -> L) etc.
+	 * - Matrix
+	 *    N * M chan file: in 1 -> out 1 .. M, in 2 -> out 1 .. M, etc.
+	 *    M is IRSettings::matrix_outputs, missing channels are not convolved.
 	 */
 
-	uint32_t n_imp = n_inputs () * n_outputs ();
+	uint32_t n_imp = n_outputs () * (_irc == Stereo ? 2 : 1);
 	uint32_t n_chn = _readables.size ();
 
+	if (_irc == Matrix) {
+		n_imp = std::min (n_chn, n_inputs () * matrix_outputs ());
+	}
+
 	if (_irc == Stereo && n_chn == 3) {
 		/* ignore 3rd channel */
 		n_chn = 2;
@@ -263,106 +850,311 @@ Convolver::reconfigure (uint32_t block_size, bool threaded)
 		n_imp = 2;
 	}
 
-#ifndef NDEBUG
-	printf ("Convolver::reconfigure Nin=%d Nout=%d Nimp=%d Nchn=%d\n", n_inputs (), n_outputs (), n_imp, n_chn);
-#endif
-
-	assert (n_imp <= 4);
-
-	for (uint32_t i = 0; i < 4; ++i) {
-		_tdc[i].reset ();
+	/* The delay that all paths of an input have in common is applied
+	 * to the input signal. It is not part of the IR, and can be changed
+	 * while processing, see set_ir_settings(). */
+	std::vector<uint32_t> in_delay (n_inputs (), 0);
+	std::vector<bool>     in_used (n_inputs (), false);
+	for (uint32_t c = 0; c < n_imp; ++c) {
+		const int      i = path_input (c, n_imp);
+		const uint32_t d = path_delay (_ir_settings, c);
+		if (_ir_end[c % n_chn] > 0 && (!in_used[i] || d < in_delay[i])) {
+			in_delay[i] = d;
+			in_used[i]  = true;
+		}
 	}
 
-	_dly[0].reset (_n_samples);
-	_dly[1].reset (_n_samples);
+	/* only convolve up to the end of the trimmed IR, including delays */
+	_max_size = 1;
+	for (uint32_t c = 0; c < n_imp; ++c) {
+		const int      ir_c       = c % n_chn;
+		const uint32_t chan_delay = path_delay (_ir_settings, c) - in_delay[path_input (c, n_imp)];
 
-	for (uint32_t c = 0; c < n_imp && rv == 0; ++c) {
-		int ir_c = c % n_chn;
-		int io_o = c % n_outputs ();
-		int io_i;
-
-		if (n_imp == 2 && _irc == Stereo) {
-			/*           (imp, in, out)
-			 * Stereo       (2, 2, 2)    1: L -> L, 2: R -> R
-			 */
-			io_i = c % n_inputs ();
-		} else {
-			/*           (imp, in, out)
-			 * Mono         (1, 1, 1)   1: M -> M
-			 * MonoToStereo (2, 1, 2)   1: M -> L, 2: M -> R
-			 * Stereo       (4, 2, 2)   1: L -> L, 2: L -> R, 3: R -> L, 4: R -> R
-			 */
-			io_i = (c / n_outputs ()) % n_inputs ();
+		if (_ir_end[ir_c] > 0) {
+			_max_size = std::max (_max_size, chan_delay + _ir_end[ir_c]);
 		}
+	}
 
-		Readable* r = _readables[ir_c];
-		assert (r->readable_length () == _max_size);
-		assert (r->n_channels () == 1);
+	/* A late cycle waits for the level, the output is complete, so
+	 * the engine must not stop, see late_cycles().
+	 * Optionally lock the engine memory while it runs, so that the
+	 * realtime thread never page-faults, see memlock(). Locked IRs
+	 * longer than 2 sec use huge pages, which saves TLB misses of the
+	 * MAC. Unlocked, the kernel may split or compact them at any time.
+	 */
+	uint32_t opts = Convproc::OPT_LATE_CONTIN;
+	if (memlock ()) {
+		opts |= Convproc::OPT_MEMLOCK | (_max_size > 2 * _samplerate ? Convproc::OPT_HUGEPAGE : 0);
+	}
+	_convproc.set_options (opts);
+	_tail.set_options (opts);
+
+	/* If enabled by `lowrate_tail`, at high sample-rates the tail of long
+	 * IRs (after ~200ms) is convolved at 1/2 or 1/4 of the rate, which
+	 * retains the audible range up to 20kHz, but not the IR above it.
+	 * The tail engine runs with a larger block-size,
+	 * its output is computed one tail-quantum ahead, and the IR offset
+	 * is reduced to compensate for this as well as for the filter and
+	 * engine latency.
+	 * Head and tail are cross-faded over ~10ms, a hard cut would add
+	 * high frequencies that the tail cannot reproduce.
+	 */
+	const uint32_t ratio  = !_ir_settings.lowrate_tail ? 1 : _samplerate >= 176400 ? 4 : _samplerate >= 88200 ? 2 : 1;
+	const uint32_t xover  = _n_samples * ceil (.2 * _samplerate / _n_samples);
+	const uint32_t xfade  = _n_samples * ceil (.01 * _samplerate / _n_samples);
+	/* without a thread, the tail is processed every cycle to avoid load spikes */
+	const uint32_t tail_q = threaded ? std::max (_n_samples / ratio, 256u) : _n_samples / ratio;
+
+	uint32_t tail_offset  = 0;
+	uint32_t tail_minpart = 0;
+
+	_tail_ratio   = 1;
+	_tail_quantum = 0;
+	_tail_pos     = 0;
+
+	if (ratio > 1 && _max_size >= 2 * xover && tail_q >= (uint32_t)Convproc::MINPART) {
+		for (uint32_t i = 0; i < std::max (n_inputs (), n_outputs ()); ++i) {
+			_dec[i].configure (ratio, _samplerate, _n_samples);
+			_int[i].configure (ratio, _samplerate, _n_samples);
+			_tail_lr[i].assign (tail_q, 0.f);
+			_tail_out[i].assign (_n_samples, 0.f);
+		}
+		/* the prefiltered tail starts delay() samples early */
+		const uint32_t fdelay = 2 * _dec[0].delay () + _int[0].delay () + ratio * tail_q;
+		/* prefer the largest minimum partition size that fits,
+		 * without a thread only minpart == quantum is supported */
+		for (uint32_t mp = threaded ? 4 * tail_q : tail_q; mp >= tail_q; mp /= 2) {
+			/* Convproc latency when minpart > quantum */
+			const uint32_t latency = mp == tail_q ? 0 : 2 * mp - tail_q;
+			const uint32_t delay   = fdelay + ratio * latency;
+			if (xover >= delay) {
+				tail_offset   = (xover - delay) / ratio;
+				tail_minpart  = mp;
+				_tail_ratio   = ratio;
+				_tail_quantum = tail_q;
+				break;
+			}
+		}
+	}
 
-		const float    chan_gain  = _ir_settings.gain * _ir_settings.channel_gain[c];
-		const uint32_t chan_delay = (_ir_settings.pre_delay + _ir_settings.channel_delay[c]) * r->resample_ratio ();
+	const uint32_t head_size = _tail_ratio > 1 ? xover + xfade : _max_size;
 
 #ifndef NDEBUG
-		printf ("Convolver map: IR-chn %d: in %d -> out %d (gain: %.1fdB delay; %d)\n", ir_c + 1, io_i + 1, io_o + 1, 20.f * log10f (fabs (chan_gain)), chan_delay);
+	printf ("Convolver::reconfigure Nin=%d Nout=%d Nimp=%d Nchn=%d len=%d%s\n", n_inputs (), n_outputs (), n_imp, n_chn, _max_size, sum_inputs () ? " (sum)" : "");
+	if (_tail_ratio > 1) {
+		printf ("Convolver: tail after %d samples at 1/%d rate\n", xover, _tail_ratio);
+	}
 #endif
 
-		/* this allows for 4 channel files
-		 *    LL, LR, RL, RR
-		 * to be used in simple stereo lower CPU configuration:
-		 *    LL, --, --, RR
-		 */
-		if (chan_gain == 0.f) {
-			continue;
-		}
+	/* number of engine paths, fewer than n_imp with summed inputs */
+	const uint32_t n_path = std::min (n_imp, n_inputs () * n_outputs ());
 
-		assert ((io_i * 2 + io_o) < 4);
-		_tdc[io_i * 2 + io_o].configure (r, chan_gain, chan_delay);
+	float density = 0;
 
-		uint32_t pos = 0;
-		while (true) {
+	if (threaded) {
+		/* prefer a measured layout, if available */
+		lookup_layout (n_inputs (), n_outputs (), n_path, _n_samples, head_size, n_part, density);
+	}
+
+	int rv = _convproc.configure (
+	    /*in*/  n_inputs (),
+	    /*out*/ n_outputs (),
+	    /*max-convolution length */ head_size,
+	    /*quantum, nominal-buffersize*/ _n_samples,
+	    /*Convproc::MINPART*/ _n_samples,
+	    /*Convproc::MAXPART*/ n_part,
+	    /*density*/ density);
+
+	if (rv == 0 && _tail_ratio > 1) {
+		rv = _tail.configure (
+		    n_inputs (),
+		    n_outputs (),
+		    tail_offset + (_max_size - xover + 2 * _dec[0].delay ()) / _tail_ratio + 2,
+		    _tail_quantum,
+		    tail_minpart,
+		    threaded ? Convproc::MAXPART : tail_minpart,
+		    0);
+	}
+
+	_tdc.assign (n_inputs () * n_outputs (), TimeDomainConvolver ());
+	_path_io.assign (n_imp, -1);
+	_path_gain.assign (n_imp, 0.f);
+	_path_delay.assign (n_imp, 0);
+
+	/* allow to increase the delay by 1 sec without a new engine */
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		_pre[i].reset (in_delay[i] + _samplerate, in_delay[i]);
+	}
+
+	for (uint32_t o = 0; o < std::max (2u, n_outputs ()); ++o) {
+		_dly[o].reset (_n_samples);
+	}
+
+	/* gains are part of the IR data */
+	for (uint32_t c = 0; c < MAXCHN; ++c) {
+		_in_gain[c]  = _in_gain_target[c]  = 1.f;
+		_out_gain[c] = _out_gain_target[c] = 1.f;
+	}
+
+	/* paths created so far, to link those using the same IR */
+	std::vector<int>      made_i (n_imp);
+	std::vector<int>      made_o (n_imp);
+	std::vector<int>      made_c (n_imp);
+	std::vector<float>    made_g (n_imp);
+	std::vector<uint32_t> made_d (n_imp);
+	uint32_t              n_made = 0;
+
+	for (uint32_t c = 0; c < n_imp && rv == 0; ++c) {
+		int ir_c = c % n_chn;
+		int io_o = path_output (c);
+		int io_i = path_input (c, n_imp);
+
+		Readable* r = _readables[ir_c];
+		assert (r->n_channels () == 1);
+
+		const uint32_t ir_start = _ir_start[ir_c];
+		const uint32_t ir_end   = _ir_end[ir_c];
+
+		const float    chan_gain  = _ir_settings.gain * channel_gain (_ir_settings, c);
+		const uint32_t chan_delay = path_delay (_ir_settings, c) - in_delay[io_i];
+
+#ifndef NDEBUG
+		printf ("Convolver map: IR-chn %d: in %d -> out %d (gain: %.1fdB delay; %d)\n", ir_c + 1, io_i + 1, io_o + 1, 20.f * log10f (fabs (chan_gain)), chan_delay);
+#endif
+
+		if (ir_end == 0) {
+			continue;
+		}
+
+		/* remember gain and delay, see set_ir_settings() */
+		_path_io[c]    = io_i * n_outputs () + io_o;
+		_path_gain[c]  = chan_gain;
+		_path_delay[c] = chan_delay;
+
+		/* this allows for 4 channel files
+		 *    LL, LR, RL, RR
+		 * to be used in simple stereo lower CPU configuration:
+		 *    LL, --, --, RR
+		 */
+		if (chan_gain == 0.f) {
+			continue;
+		}
+
+		assert ((io_i * n_outputs () + io_o) < _tdc.size ());
+		_tdc[io_i * n_outputs () + io_o].configure (r, chan_gain, chan_delay);
+
+		const float link_gain = chan_gain * _ir_scale[ir_c];
+
+		/* paths that IR channels are added to cannot be linked */
+		uint32_t d = n_made;
+		for (uint32_t k = 0; k < n_made && n_path == n_imp; ++k) {
+			if (made_c[k] == (int)_ir_root[ir_c] && made_d[k] == chan_delay) {
+				d = k;
+				break;
+			}
+		}
+
+		if (d < n_made) {
+#ifndef NDEBUG
+			printf ("Convolver map: in %d -> out %d shares the IR of in %d -> out %d\n", io_i + 1, io_o + 1, made_i[d] + 1, made_o[d] + 1);
+#endif
+			const float g = link_gain / made_g[d];
+			rv            = _convproc.impdata_link (made_i[d], made_o[d], io_i, io_o, g);
+			if (rv == 0 && _tail_ratio > 1) {
+				rv = _tail.impdata_link (made_i[d], made_o[d], io_i, io_o, g);
+			}
+			continue;
+		}
+
+		made_i[n_made] = io_i;
+		made_o[n_made] = io_o;
+		made_c[n_made] = _ir_root[ir_c];
+		made_g[n_made] = link_gain;
+		made_d[n_made] = chan_delay;
+		++n_made;
+
+		std::vector<float> tail;
+		if (_tail_ratio > 1) {
+			tail.resize (_max_size - xover, 0.f);
+		}
+
+		/* read sequentially from the start (resampling), but only
+		 * add the audible part [ir_start, ir_end) */
+		uint32_t pos = 0;
+		while (pos < ir_end) {
 			float ir[8192];
 
-			uint64_t to_read = std::min ((uint32_t)8192, _max_size - pos);
+			uint64_t to_read = std::min ((uint32_t)8192, ir_end - pos);
 			uint64_t ns      = r->read (ir, pos, to_read, 0);
 
 			if (ns == 0) {
-				assert (pos == _max_size);
 				break;
 			}
 
+			if (pos + ns <= ir_start) {
+				pos += ns;
+				continue;
+			}
+
+			const uint32_t skip = pos < ir_start ? ir_start - pos : 0;
+
 			if (chan_gain != 1.f) {
-				for (uint64_t i = 0; i < ns; ++i) {
+				for (uint64_t i = skip; i < ns; ++i) {
 					ir[i] *= chan_gain;
 				}
 			}
 
-			rv = _convproc.impdata_create (
-			    /*i/o map */ io_i, io_o,
-			    /*stride, de-interleave */ 1,
-			    ir,
-			    chan_delay + pos, chan_delay + pos + ns);
+			const uint32_t i0 = chan_delay + pos + skip;
+			const uint32_t i1 = chan_delay + pos + ns;
+
+			for (uint32_t i = std::max (i0, xover); i < i1 && _tail_ratio > 1; ++i) {
+				float& v = ir[i - chan_delay - pos];
+				if (i < head_size) {
+					const float w = .5f + .5f * cosf (M_PI * (i - xover) / xfade);
+					tail[i - xover] = v * (1.f - w);
+					v *= w;
+				} else {
+					tail[i - xover] = v;
+				}
+			}
+
+			if (i0 < head_size) {
+				rv = _convproc.impdata_create (
+				    /*i/o map */ io_i, io_o,
+				    /*stride, de-interleave */ 1,
+				    &ir[skip],
+				    i0, std::min (i1, head_size));
+			}
 
 			if (rv != 0) {
 				break;
 			}
 
 			pos += ns;
+		}
 
-			if (pos == _max_size) {
-				break;
-			}
+		if (rv == 0 && _tail_ratio > 1) {
+			std::vector<float> lowrate;
+			_dec[0].downsample (&tail[0], tail.size (), _dec[0].delay (), lowrate);
+			rv = _tail.impdata_create (io_i, io_o, 1, &lowrate[0], tail_offset, tail_offset + lowrate.size ());
 		}
 	}
 
 	if (rv == 0) {
-		rv = _convproc.start_process (_sched_priority, _sched_policy, _period_ns);
+		rv = start ? _convproc.start_process (_sched_priority, _sched_policy, _period_ns) : _convproc.prepare_process ();
+	}
+
+	if (rv == 0 && _tail_ratio > 1) {
+		rv = start ? _tail.start_process (_sched_priority, _sched_policy, _period_ns) : _tail.prepare_process ();
 	}
 
 	assert (rv == 0); // bail out in debug builds
 
 	if (rv != 0) {
 		_convproc.stop_process ();
+		_tail.stop_process ();
 		_convproc.cleanup ();
+		_tail.cleanup ();
 		_configured = false;
 		return;
 	}
@@ -371,24 +1163,378 @@ Convolver::reconfigure (uint32_t block_size, bool threaded)
 
 #ifndef NDEBUG
 	_convproc.print (stdout);
+	if (_tail_ratio > 1) {
+		_tail.print (stdout);
+	}
 #endif
 }
 
+/* The gains are part of the IR data. A change is applied as a gain
+ * relative to that, per engine path. IR channels that are added to
+ * the same path (summed inputs) need to change by the same ratio.
+ *
+ * Delays are part of the IR as well, except for the delay that all
+ * paths of an input have in common. A change is possible if it is the
+ * same for all paths of an input, and within the capacity of its
+ * PreDelay. This is always the case for the pre-delay.
+ */
+/* the ratio of paths in * n_out + out, if it is the same for all
+ * inputs of each output (by_out), or all outputs of each input */
+static bool
+common_ratio (std::vector<float> const& ratio, std::vector<bool> const& isset,
+              uint32_t n_in, uint32_t n_out, bool by_out, float* gain)
+{
+	const uint32_t n = by_out ? n_out : n_in;
+	const uint32_t m = by_out ? n_in : n_out;
+
+	for (uint32_t k = 0; k < n; ++k) {
+		bool set = false;
+		gain[k]  = 1.f;
+		for (uint32_t j = 0; j < m; ++j) {
+			const uint32_t p = by_out ? j * n_out + k : k * n_out + j;
+			if (!isset[p]) {
+				continue;
+			}
+			if (set && fabsf (ratio[p] - gain[k]) > 1e-6f * fabsf (ratio[p])) {
+				return false;
+			}
+			gain[k] = ratio[p];
+			set     = true;
+		}
+	}
+	return true;
+}
+
+bool
+Convolver::same_engine (IRSettings const& a, IRSettings const& b)
+{
+	return a.artificial_latency == b.artificial_latency
+	       && a.sum_inputs == b.sum_inputs
+	       && a.trim_threshold == b.trim_threshold
+	       && a.lowrate_tail == b.lowrate_tail
+	       && a.matrix_outputs == b.matrix_outputs;
+}
+
+bool
+Convolver::set_ir_settings (IRSettings const& irs)
+{
+	IRUpdate u;
+	if (!prepare_ir_settings (irs, u)) {
+		return false;
+	}
+	apply_ir_settings (u);
+	return true;
+}
+
+bool
+Convolver::prepare_ir_settings (IRSettings const& irs, IRUpdate& u) const
+{
+	if (!_configured || !same_engine (irs, _ir_settings) || !channel_settings_ok (irs)) {
+		return false;
+	}
+
+	const uint32_t n_in    = n_inputs ();
+	const uint32_t n_out   = n_outputs ();
+	const uint32_t n_paths = n_in * n_out;
+
+	std::vector<float> ratio (n_paths, 1.f);
+	std::vector<bool>  isset (n_paths, false);
+
+	for (uint32_t c = 0; c < _path_io.size (); ++c) {
+		const int   p = _path_io[c];
+		const float g = irs.gain * channel_gain (irs, c);
+		if (p < 0) {
+			continue;
+		}
+		if (_path_gain[c] == 0.f) {
+			if (g != 0.f) {
+				return false;
+			}
+			continue;
+		}
+		const float r = g / _path_gain[c];
+		if (isset[p] && fabsf (r - ratio[p]) > 1e-6f * fabsf (r)) {
+			return false;
+		}
+		ratio[p] = r;
+		isset[p] = true;
+	}
+
+	/* The IR data of a path cannot be scaled without a step in the
+	 * output, the change is applied to the outputs or the inputs. */
+	if (common_ratio (ratio, isset, n_in, n_out, true, u.out_gain)) {
+		for (uint32_t i = 0; i < n_in; ++i) {
+			u.in_gain[i] = 1.f;
+		}
+	} else if (common_ratio (ratio, isset, n_in, n_out, false, u.in_gain)) {
+		for (uint32_t o = 0; o < n_out; ++o) {
+			u.out_gain[o] = 1.f;
+		}
+	} else {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < n_in; ++i) {
+		u.in_delay[i] = -1;
+	}
+
+	for (uint32_t c = 0; c < _path_io.size (); ++c) {
+		const int p = _path_io[c];
+		if (p < 0) {
+			continue;
+		}
+		const int64_t d = (int64_t)path_delay (irs, c) - _path_delay[c];
+		if (d < 0 || d > _pre[p / n_out].capacity ()) {
+			return false;
+		}
+		if (u.in_delay[p / n_out] >= 0 && u.in_delay[p / n_out] != d) {
+			return false;
+		}
+		u.in_delay[p / n_out] = d;
+	}
+
+	u.irs = irs;
+	return true;
+}
+
+void
+Convolver::apply_ir_settings (IRUpdate const& u)
+{
+	const uint32_t n_in  = n_inputs ();
+	const uint32_t n_out = n_outputs ();
+
+	for (uint32_t i = 0; i < n_in; ++i) {
+		_in_gain_target[i] = u.in_gain[i];
+	}
+	for (uint32_t o = 0; o < n_out; ++o) {
+		_out_gain_target[o] = u.out_gain[o];
+	}
+
+	for (uint32_t i = 0; i < n_in; ++i) {
+		if (u.in_delay[i] >= 0) {
+			_pre[i].set_delay (u.in_delay[i]);
+		}
+	}
+
+	_ir_settings.gain      = u.irs.gain;
+	_ir_settings.pre_delay = u.irs.pre_delay;
+	memcpy (_ir_settings.channel_gain, u.irs.channel_gain, sizeof (u.irs.channel_gain));
+	memcpy (_ir_settings.channel_delay, u.irs.channel_delay, sizeof (u.irs.channel_delay));
+}
+
+/* IRSettings::channel_gain and channel_delay cover the 4 channels of a
+ * true-stereo IR. For IRs with more channels (Matrix) they would only
+ * apply to some paths, and must be left at their defaults. */
+bool
+Convolver::channel_settings_ok (IRSettings const& irs) const
+{
+	if (_readables.size () <= 4) {
+		return true;
+	}
+	for (uint32_t c = 0; c < 4; ++c) {
+		if (irs.channel_gain[c] != 1.f || irs.channel_delay[c] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+Convolver::memlock ()
+{
+	const char* env = getenv ("ZCONVOLV_MEMLOCK");
+	return env && *env && strcmp (env, "0") != 0;
+}
+
+void
+Convolver::memory_stats (size_t& bytes, size_t& locked, uint32_t& count) const
+{
+	size_t   b, l;
+	uint32_t c;
+	_convproc.memory_stats (bytes, locked, count);
+	_tail.memory_stats (b, l, c);
+	bytes += b;
+	locked += l;
+	count += c;
+}
+
+void
+Convolver::skip_stats (Convproc::SkipStats& s) const
+{
+	_convproc.skip_stats (s);
+	_tail.skip_stats (s);
+}
+
+/* The IR is read again by reconfigure(), count it as if it was
+ * in memory, which it is for mem: sources. */
+size_t
+Convolver::data_bytes () const
+{
+	size_t bytes = (size_t)ir_length () * _readables.size () * sizeof (float);
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		bytes += (_pre[i].capacity () + 1) * sizeof (float);
+	}
+	return bytes;
+}
+
 bool
 Convolver::ready () const
 {
-	return _configured && _convproc.state () == Convproc::ST_PROC;
+	return _configured && _convproc.state () == Convproc::ST_PROC && (_tail_ratio == 1 || _tail.state () == Convproc::ST_PROC);
 }
 
 bool
-Convolver::reset ()
+Convolver::parked () const
+{
+	return _configured && _convproc.state () == Convproc::ST_STOP && (_tail_ratio == 1 || _tail.state () == Convproc::ST_STOP);
+}
+
+void
+Convolver::park ()
 {
 	if (!ready ()) {
+		return;
+	}
+	_convproc.stop_process ();
+	if (_tail_ratio > 1) {
+		_tail.stop_process ();
+	}
+	while (!_convproc.check_stop () || (_tail_ratio > 1 && !_tail.check_stop ())) {
+		usleep (10000);
+	}
+	_convproc.unlock_memory ();
+	_tail.unlock_memory ();
+}
+
+bool
+Convolver::reset ()
+{
+	if (!ready () && !parked ()) {
 		return false;
 	}
+	if (_suspend == Suspended) {
+		_suspend = Flushed;
+	}
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		_pre[i].clear ();
+	}
+	if (_tail_ratio > 1) {
+		for (uint32_t i = 0; i < std::max (n_inputs (), n_outputs ()); ++i) {
+			_dec[i].clear ();
+			_int[i].clear ();
+			std::fill (_tail_lr[i].begin (), _tail_lr[i].end (), 0.f);
+			std::fill (_tail_out[i].begin (), _tail_out[i].end (), 0.f);
+		}
+		_tail_pos = 0;
+		if (_tail.restart_process (_sched_priority, _sched_policy, _period_ns)) {
+			return false;
+		}
+	}
 	return 0 == _convproc.restart_process (_sched_priority, _sched_policy, _period_ns);
 }
 
+bool
+Convolver::flush ()
+{
+	if (!ready () || _suspend != Suspended) {
+		return false;
+	}
+	_offset = 0;
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		_pre[i].clear ();
+	}
+	if (_tail_ratio > 1) {
+		for (uint32_t i = 0; i < std::max (n_inputs (), n_outputs ()); ++i) {
+			_dec[i].clear ();
+			_int[i].clear ();
+			std::fill (_tail_lr[i].begin (), _tail_lr[i].end (), 0.f);
+			std::fill (_tail_out[i].begin (), _tail_out[i].end (), 0.f);
+		}
+		_tail_pos = 0;
+		if (_tail.flush ()) {
+			return false;
+		}
+	}
+	return 0 == _convproc.flush ();
+}
+
+void
+Convolver::flush_done ()
+{
+	if (_suspend == Suspended) {
+		_suspend = Flushed;
+	}
+}
+
+bool
+Convolver::bypass ()
+{
+	switch (_suspend) {
+		case Active:
+			if (_enabled || _wet != 0 || _wet_target != 0) {
+				return false;
+			}
+			_suspend = Suspended;
+			break;
+		case Flushed:
+			if (_enabled) {
+				/* the wet signal fades in from zero */
+				_suspend = Active;
+				return false;
+			}
+			break;
+		default:
+			break;
+	}
+	return true;
+}
+
+static inline void
+interpolate (float& cur, float target, float a)
+{
+	if (cur != target) {
+		cur += a * (target - cur) + 1e-10f;
+		if (fabsf (cur - target) < 1e-5f) {
+			cur = target;
+		}
+	}
+}
+
+void
+Convolver::run_bypass (float* const* bufs, uint32_t n_chn, uint32_t n_samples, bool buffered)
+{
+	uint32_t done   = 0;
+	uint32_t remain = n_samples;
+
+	while (remain > 0) {
+		uint32_t ns = std::min (remain, _n_samples);
+
+		/* only the dry signal is faded, wet remains off */
+		interpolate (_dry, _dry_target, _a);
+
+		for (uint32_t c = 0; c < n_chn; ++c) {
+			float* const buf = &bufs[c][done];
+			if (_dry == _dry_target && _dry == 0) {
+				_dly[c].clear ();
+				memset (buf, 0, sizeof (float) * ns);
+				continue;
+			}
+			if (buffered) {
+				_dly[c].run (buf, ns);
+			}
+			if (_dry != 1.f) {
+				const float dry = _dry;
+				for (uint32_t i = 0; i < ns; ++i) {
+					buf[i] *= dry;
+				}
+			}
+		}
+
+		done   += ns;
+		remain -= ns;
+	}
+}
+
 void
 Convolver::set_output_gain (float dry, float wet, bool interpolate)
 {
@@ -400,53 +1546,143 @@ Convolver::set_output_gain (float dry, float wet, bool interpolate)
 	}
 }
 
+void
+Convolver::set_freewheel (bool fw)
+{
+	if (_freewheel == fw) {
+		return;
+	}
+	_freewheel = fw;
+	_convproc.set_sync (fw);
+	_tail.set_sync (fw);
+}
+
 void
 Convolver::interpolate_gain ()
 {
-	if (_dry != _dry_target) {
-		_dry += _a * (_dry_target - _dry) + 1e-10f;
-		if (fabsf (_dry - _dry_target) < 1e-5f) {
-			_dry = _dry_target;
-		}
+	interpolate (_dry, _dry_target, _a);
+	interpolate (_wet, _wet_target, _a);
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		interpolate (_in_gain[i], _in_gain_target[i], _a);
 	}
-	if (_wet != _wet_target) {
-		_wet += _a * (_wet_target - _wet) + 1e-10f;
-		if (fabsf (_wet - _wet_target) < 1e-5f) {
-			_wet = _wet_target;
+	for (uint32_t o = 0; o < n_outputs (); ++o) {
+		interpolate (_out_gain[o], _out_gain_target[o], _a);
+	}
+}
+
+/* delay engine input i, and apply its gain change */
+void
+Convolver::input (uint32_t i, float const* src, uint32_t n)
+{
+	float* const dst = &_convproc.inpdata (i)[_offset];
+	_pre[i].run (dst, src, n);
+	if (_in_gain[i] != 1.f) {
+		const float g = _in_gain[i];
+		for (uint32_t k = 0; k < n; ++k) {
+			dst[k] *= g;
 		}
 	}
 }
 
 void
-Convolver::output (float* dst, const float* src, uint32_t n) const
+Convolver::output (float* dst, const float* src, uint32_t n, uint32_t o) const
 {
-	if (_dry == 0.f && _wet == 1.f) {
+	const float wet = _wet * _out_gain[o];
+	if (_dry == 0.f && wet == 1.f) {
 		memcpy (dst, src, n * sizeof (float));
 	} else {
 		const float dry = _dry;
-		const float wet = _wet;
 		for (uint32_t i = 0; i < n; ++i) {
 			dst[i] = dry * dst[i] + wet * src[i];
 		}
 	}
 }
 
+/* process a complete cycle */
+void
+Convolver::process ()
+{
+	if (_tail_ratio == 1) {
+		if (_convproc.process () & Convproc::FL_LATE) {
+			++_late;
+		}
+		return;
+	}
+
+	const uint32_t n_low = _n_samples / _tail_ratio;
+
+	for (uint32_t i = 0; i < n_inputs (); ++i) {
+		_dec[i].decimate (_convproc.inpdata (i), _tail.inpdata (i) + _tail_pos, _n_samples);
+	}
+
+	if (_convproc.process () & Convproc::FL_LATE) {
+		++_late;
+	}
+
+	for (uint32_t o = 0; o < n_outputs (); ++o) {
+		float* const out = _convproc.outdata (o);
+		for (uint32_t i = 0; i < _n_samples; ++i) {
+			out[i] += _tail_out[o][i];
+		}
+	}
+
+	/* a complete tail quantum is output during the following cycles */
+	_tail_pos += n_low;
+	if (_tail_pos == _tail_quantum) {
+		if (_tail.process () & Convproc::FL_LATE) {
+			++_late;
+		}
+		for (uint32_t o = 0; o < n_outputs (); ++o) {
+			memcpy (&_tail_lr[o][0], _tail.outdata (o), _tail_quantum * sizeof (float));
+		}
+		_tail_pos = 0;
+	}
+
+	/* prepare the tail for the next cycle */
+	for (uint32_t o = 0; o < n_outputs (); ++o) {
+		std::fill (_tail_out[o].begin (), _tail_out[o].end (), 0.f);
+		_int[o].interpolate (&_tail_lr[o][_tail_pos], &_tail_out[o][0], _n_samples);
+	}
+}
+
+/* process a partial cycle, direct-output */
+void
+Convolver::tailonly (uint32_t n_samples)
+{
+	_convproc.tailonly (n_samples);
+
+	if (_tail_ratio == 1) {
+		return;
+	}
+
+	for (uint32_t o = 0; o < n_outputs (); ++o) {
+		float* const out = _convproc.outdata (o);
+		for (uint32_t i = 0; i < n_samples; ++i) {
+			out[i] += _tail_out[o][i];
+		}
+	}
+}
+
 void
 Convolver::run_buffered_mono (float* buf, uint32_t n_samples)
 {
 	assert (_convproc.state () == Convproc::ST_PROC);
 	assert (_irc == Mono);
 
+	if (bypass ()) {
+		run_bypass (&buf, 1, n_samples, true);
+		return;
+	}
+
 	uint32_t done   = 0;
 	uint32_t remain = n_samples;
 
 	while (remain > 0) {
 		uint32_t ns = std::min (remain, _n_samples - _offset);
 
-		float* const       in  = _convproc.inpdata (/*channel*/ 0);
 		float const* const out = _convproc.outdata (/*channel*/ 0);
 
-		memcpy (&in[_offset], &buf[done], sizeof (float) * ns);
+		input (0, &buf[done], ns);
 
 		if (_dry == _dry_target && _dry == 0) {
 			_dly[0].clear ();
@@ -455,14 +1691,14 @@ Convolver::run_buffered_mono (float* buf, uint32_t n_samples)
 		}
 
 		interpolate_gain ();
-		output (&buf[done], &out[_offset], ns);
+		output (&buf[done], &out[_offset], ns, 0);
 
 		_offset += ns;
 		done    += ns;
 		remain  -= ns;
 
 		if (_offset == _n_samples) {
-			_convproc.process ();
+			process ();
 			_offset = 0;
 		}
 	}
@@ -474,15 +1710,21 @@ Convolver::run_buffered_stereo (float* left, float* right, uint32_t n_samples)
 	assert (_convproc.state () == Convproc::ST_PROC);
 	assert (_irc != Mono);
 
+	if (bypass ()) {
+		float* const bufs[2] = { left, right };
+		run_bypass (bufs, 2, n_samples, true);
+		return;
+	}
+
 	uint32_t done   = 0;
 	uint32_t remain = n_samples;
 
 	while (remain > 0) {
 		uint32_t ns = std::min (remain, _n_samples - _offset);
 
-		memcpy (&_convproc.inpdata (0)[_offset], &left[done], sizeof (float) * ns);
-		if (_irc >= Stereo) {
-			memcpy (&_convproc.inpdata (1)[_offset], &right[done], sizeof (float) * ns);
+		input (0, &left[done], ns);
+		if (n_inputs () > 1) {
+			input (1, &right[done], ns);
 		}
 
 		if (_dry == _dry_target && _dry == 0) {
@@ -494,15 +1736,15 @@ Convolver::run_buffered_stereo (float* left, float* right, uint32_t n_samples)
 		}
 
 		interpolate_gain ();
-		output (&left[done], &_convproc.outdata (0)[_offset], ns);
-		output (&right[done], &_convproc.outdata (1)[_offset], ns);
+		output (&left[done], &_convproc.outdata (0)[_offset], ns, 0);
+		output (&right[done], &_convproc.outdata (1)[_offset], ns, 1);
 
 		_offset += ns;
 		done    += ns;
 		remain  -= ns;
 
 		if (_offset == _n_samples) {
-			_convproc.process ();
+			process ();
 			_offset = 0;
 		}
 	}
@@ -514,6 +1756,11 @@ Convolver::run_mono (float* buf, uint32_t n_samples)
 	assert (_convproc.state () == Convproc::ST_PROC);
 	assert (_irc == Mono);
 
+	if (bypass ()) {
+		run_bypass (&buf, 1, n_samples, false);
+		return;
+	}
+
 	uint32_t done   = 0;
 	uint32_t remain = n_samples;
 
@@ -523,19 +1770,19 @@ Convolver::run_mono (float* buf, uint32_t n_samples)
 		float* const in  = _convproc.inpdata (/*channel*/ 0);
 		float* const out = _convproc.outdata (/*channel*/ 0);
 
-		memcpy (&in[_offset], &buf[done], sizeof (float) * ns);
+		input (0, &buf[done], ns);
 
 		if (_offset + ns == _n_samples) {
-			_convproc.process ();
+			process ();
 			interpolate_gain ();
-			output (&buf[done], &out[_offset], ns);
+			output (&buf[done], &out[_offset], ns, 0);
 			_offset = 0;
 		} else {
 			assert (remain == ns);
-			_convproc.tailonly (_offset + ns);
-			_tdc[0].run (&out[_offset], &buf[done], ns);
+			tailonly (_offset + ns);
+			_tdc[0].run (out, in, _offset + ns);
 			interpolate_gain ();
-			output (&buf[done], &out[_offset], ns);
+			output (&buf[done], &out[_offset], ns, 0);
 			_offset += ns;
 		}
 		done   += ns;
@@ -549,6 +1796,12 @@ Convolver::run_stereo (float* left, float* right, uint32_t n_samples)
 	assert (_convproc.state () == Convproc::ST_PROC);
 	assert (_irc != Mono);
 
+	if (bypass ()) {
+		float* const bufs[2] = { left, right };
+		run_bypass (bufs, 2, n_samples, false);
+		return;
+	}
+
 	uint32_t done   = 0;
 	uint32_t remain = n_samples;
 
@@ -558,35 +1811,86 @@ Convolver::run_stereo (float* left, float* right, uint32_t n_samples)
 	while (remain > 0) {
 		uint32_t ns = std::min (remain, _n_samples - _offset);
 
-		memcpy (&_convproc.inpdata (0)[_offset], &left[done], sizeof (float) * ns);
-		if (_irc >= Stereo) {
-			memcpy (&_convproc.inpdata (1)[_offset], &right[done], sizeof (float) * ns);
+		input (0, &left[done], ns);
+		if (n_inputs () > 1) {
+			input (1, &right[done], ns);
 		}
 
 		if (_offset + ns == _n_samples) {
-			_convproc.process ();
+			process ();
 			interpolate_gain ();
-			output (&left[done],  &outL[_offset], ns);
-			output (&right[done], &outR[_offset], ns);
+			output (&left[done],  &outL[_offset], ns, 0);
+			output (&right[done], &outR[_offset], ns, 1);
 			_offset = 0;
 		} else {
 			assert (remain == ns);
-			_convproc.tailonly (_offset + ns);
+			tailonly (_offset + ns);
 
-			_tdc[0].run (outL, _convproc.inpdata (0), _offset + ns);
-			_tdc[2].run (outR, _convproc.inpdata (0), _offset + ns);
-
-			if (_irc >= Stereo) {
-				_tdc[1].run (outL, _convproc.inpdata (1), _offset + ns);
-				_tdc[3].run (outR, _convproc.inpdata (1), _offset + ns);
+			/* engine path in -> out, see reconfigure() */
+			for (uint32_t i = 0; i < n_inputs (); ++i) {
+				_tdc[i * n_outputs () + 0].run (outL, _convproc.inpdata (i), _offset + ns);
+				_tdc[i * n_outputs () + 1].run (outR, _convproc.inpdata (i), _offset + ns);
 			}
 
 			interpolate_gain ();
-			output (&left[done],  &outL[_offset], ns);
-			output (&right[done], &outR[_offset], ns);
+			output (&left[done],  &outL[_offset], ns, 0);
+			output (&right[done], &outR[_offset], ns, 1);
 			_offset += ns;
 		}
 		done   += ns;
 		remain -= ns;
 	}
 }
+
+void
+Convolver::run_buffered_multi (float* const* buf, uint32_t n_samples)
+{
+	assert (_convproc.state () == Convproc::ST_PROC);
+	assert (_irc == Matrix);
+
+	const uint32_t n_in  = n_inputs ();
+	const uint32_t n_out = n_outputs ();
+
+	/* outputs without a corresponding input have no dry signal */
+	for (uint32_t o = n_in; o < n_out; ++o) {
+		memset (buf[o], 0, sizeof (float) * n_samples);
+	}
+
+	if (bypass ()) {
+		run_bypass (buf, n_out, n_samples, true);
+		return;
+	}
+
+	uint32_t done   = 0;
+	uint32_t remain = n_samples;
+
+	while (remain > 0) {
+		uint32_t ns = std::min (remain, _n_samples - _offset);
+
+		for (uint32_t i = 0; i < n_in; ++i) {
+			input (i, &buf[i][done], ns);
+		}
+
+		for (uint32_t o = 0; o < n_out; ++o) {
+			if (_dry == _dry_target && _dry == 0) {
+				_dly[o].clear ();
+			} else {
+				_dly[o].run (&buf[o][done], ns);
+			}
+		}
+
+		interpolate_gain ();
+		for (uint32_t o = 0; o < n_out; ++o) {
+			output (&buf[o][done], &_convproc.outdata (o)[_offset], ns, o);
+		}
+
+		_offset += ns;
+		done    += ns;
+		remain  -= ns;
+
+		if (_offset == _n_samples) {
+			process ();
+			_offset = 0;
+		}
+	}
+}
@@ -42,6 +42,33 @@ private:
 	uint32_t _pos;
 };
 
+/* Delay of an engine input. The delay can be changed while
+ * processing, up to the capacity given to reset(). The output
+ * cross-fades from the old to the new delay over FADE_LEN samples.
+ */
+class PreDelay
+{
+public:
+	PreDelay ();
+	~PreDelay ();
+	void clear ();
+	void reset (uint32_t capacity, uint32_t delay);
+	bool set_delay (uint32_t delay);
+	void run (float* dst, float const* src, uint32_t n_samples);
+
+	uint32_t capacity () const { return _size > 0 ? _size - 1 : 0; }
+
+	enum { FADE_LEN = 64 };
+
+private:
+	float*   _buf;
+	uint32_t _size;
+	uint32_t _delay;
+	uint32_t _prev; ///< delay to fade out from
+	uint32_t _fade; ///< remaining samples of the cross-fade
+	uint32_t _pos;
+};
+
 class TimeDomainConvolver
 {
 public:
@@ -55,6 +82,35 @@ private:
 	float _ir[64];
 };
 
+/* Windowed-sinc lowpass to change the sample rate by an integer ratio.
+ * The passband extends to 20kHz (or 90% of the lower Nyquist frequency),
+ * the group-delay is a multiple of the ratio.
+ */
+class MultiRateFilter
+{
+public:
+	MultiRateFilter ();
+	void configure (uint32_t ratio, uint32_t sample_rate, uint32_t max_block);
+	void clear ();
+
+	/* filter n_samples, write n_samples / ratio */
+	void decimate (float const* in, float* out, uint32_t n_samples);
+	/* read n_samples / ratio, add n_samples to out */
+	void interpolate (float const* in, float* out, uint32_t n_samples);
+
+	/* zero-phase lowpass at the high rate, then pick every ratio'th sample,
+	 * scaled by the ratio. out[i] corresponds to in[i * ratio - offset] */
+	void downsample (float const* in, uint32_t len, uint32_t offset, std::vector<float>& out) const;
+
+	uint32_t delay () const { return (_h.size () - 1) / 2; }
+
+private:
+	uint32_t           _ratio;
+	std::vector<float> _h;
+	std::vector<float> _poly;
+	std::vector<float> _z;
+};
+
 class Convolver
 {
 public:
@@ -62,8 +118,21 @@ public:
 		Mono,         ///< 1 in, 1 out; 1ch IR
 		MonoToStereo, ///< 1 in, 2 out, stereo IR  M -> L, M -> R
 		Stereo,       ///< 2 in, 2 out, stereo IR  L -> L, R -> R || 4 chan IR  L -> L, L -> R, R -> R, R -> L
+		Matrix,       ///< N in, M out, N * M chan IR  1 -> 1, 1 -> 2, .. 1 -> M, 2 -> 1, .. N -> M
 	};
 
+	enum {
+		MAXCHN = 16 ///< max. inputs and outputs of the Matrix config
+	};
+
+	/* Input blocks with a mean square below SILENCE_POWER (-150 dBFS)
+	 * are not transformed, and high frequency bins of late partitions
+	 * that hold less than SPARSE_ERROR (-80 dB) of the IR's energy are
+	 * not multiplied, see Convproc::set_silence_threshold() and
+	 * Convproc::set_sparse_threshold(). */
+	static const float SILENCE_POWER;
+	static const float SPARSE_ERROR;
+
 	struct IRSettings {
 		IRSettings ()
 		{
@@ -71,6 +140,9 @@ public:
 			pre_delay          = 0.0;
 			artificial_latency = 0;
 			sum_inputs         = false;
+			trim_threshold     = -120.0;
+			matrix_outputs     = 0;
+			lowrate_tail       = false;
 
 			channel_gain[0] = channel_gain[1] = channel_gain[2] = channel_gain[3] = 1.0;
 			channel_delay[0] = channel_delay[1] = channel_delay[2] = channel_delay[3] = 0;
@@ -82,6 +154,9 @@ public:
 		float   channel_gain[4];
 		int32_t channel_delay[4];
 		bool    sum_inputs;
+		float   trim_threshold; ///< dB relative to peak, 0: do not trim
+		int32_t matrix_outputs; ///< Matrix: outputs per input in the IR file, 0: all
+		bool    lowrate_tail;   ///< convolve the tail at 1/2 or 1/4 rate, >= 88.2kHz only
 	};
 
 	Convolver (std::string const&,
@@ -89,10 +164,14 @@ public:
 	           int             sched_policy,
 	           int             sched_priority,
 	           IRChannelConfig irc = Mono,
-	           IRSettings      irs = IRSettings ());
+	           IRSettings      irs = IRSettings (),
+	           uint32_t        n_inputs = 0,
+	           uint32_t        n_outputs = 0);
 	~Convolver ();
 
-	void reconfigure (uint32_t, bool threaded = true);
+	/* Without start, the engine is prepared but parked,
+	 * reset() starts the background threads. */
+	void reconfigure (uint32_t, bool threaded = true, bool start = true);
 
 	void run_buffered_mono (float*, uint32_t);
 	void run_buffered_stereo (float* L, float* R, uint32_t);
@@ -100,52 +179,186 @@ public:
 	void run_mono (float*, uint32_t);
 	void run_stereo (float* L, float* R, uint32_t);
 
+	/* Matrix: process max (n_inputs, n_outputs) buffers in-place */
+	void run_buffered_multi (float* const*, uint32_t);
+
 	/* gain coefficients */
 	void set_output_gain (float dry, float wet, bool interpolate = true);
 
+	/* While the host is freewheeling, process the partitions of the
+	 * background threads in the calling thread, see Convproc::set_sync().
+	 * The output is the same, this can be changed between calls to run_*().
+	 */
+	void set_freewheel (bool);
+
+	/* When disabled and the wet signal has faded out, the engine is
+	 * suspended and only the (delayed) dry signal is passed on.
+	 * Before resuming, flush() must be called from a non-realtime
+	 * thread, followed by flush_done() in the realtime thread.
+	 */
+	void set_enabled (bool en) { _enabled = en; }
+	bool needs_flush () const { return _enabled && _suspend == Suspended; }
+	bool flush ();
+	void flush_done ();
+
+	/* Take the engine offline when another engine replaces it, the
+	 * buffers are stale until flush() and flush_done() were called.
+	 */
+	void suspend () { _suspend = Suspended; }
+	bool suspended () const { return _suspend == Suspended; }
+
+	/* A change of gain, channel_gain, pre_delay and channel_delay */
+	struct IRUpdate {
+		IRSettings irs;
+		float      in_gain[MAXCHN];
+		float      out_gain[MAXCHN];
+		int32_t    in_delay[MAXCHN]; ///< -1: unchanged
+	};
+
+	/* Compute the change from the engine's settings to the given ones.
+	 * Gain changes must be the same for all paths of an output, or for
+	 * all paths of an input. This fails if other settings differ, or if
+	 * the change needs a new engine, e.g. a channel that was muted before.
+	 * This does not modify the engine, and can be called from any thread.
+	 */
+	bool prepare_ir_settings (IRSettings const&, IRUpdate&) const;
+
+	/* Apply a change to the running engine, gain changes fade in and
+	 * delay changes cross-fade. Must be called from the thread that
+	 * calls run_*(), or while not processing. */
+	void apply_ir_settings (IRUpdate const&);
+
+	/* prepare and apply, for engines that are not processing */
+	bool set_ir_settings (IRSettings const&);
+
+	/* true if an engine loaded with either settings can be changed to
+	 * the other one by set_ir_settings(), gain and delay aside */
+	static bool same_engine (IRSettings const&, IRSettings const&);
+
 	/* status */
 	uint32_t latency   () const { return _n_samples; }
-	uint32_t n_inputs  () const { return _irc < Stereo ? 1 : 2; }
-	uint32_t n_outputs () const { return _irc == Mono  ? 1 : 2; }
+	uint32_t n_inputs  () const { return _irc == Matrix ? _n_in : (_irc < Stereo || _ir_settings.sum_inputs) ? 1 : 2; }
+	uint32_t n_outputs () const { return _irc == Matrix ? _n_out : _irc == Mono ? 1 : 2; }
 
 	std::string const& path () const { return _path; }
 	IRSettings const&  settings () const { return _ir_settings; }
 	bool sum_inputs () const { return _ir_settings.sum_inputs; }
 	int32_t artificial_latency () const { return _artificial_latency; }
 
+	/* IR length before and after trimming silence */
+	uint32_t ir_length () const { return _readables[0]->readable_length (); }
+	uint32_t ir_start () const;
+	uint32_t ir_end () const;
+
+	/* engine memory, see Convproc::memory_stats() */
+	void memory_stats (size_t& bytes, size_t& locked, uint32_t& count) const;
+
+	/* true if $ZCONVOLV_MEMLOCK is set (and not "0"): the memory of
+	 * running engines is locked, parked ones are unlocked */
+	static bool memlock ();
+
+	/* work skipped by the engine, see Convproc::skip_stats() */
+	void skip_stats (Convproc::SkipStats&) const;
+
+	/* memory outside the engine: IR samples and input delay-lines */
+	size_t data_bytes () const;
+
+	/* number of cycles since reconfigure() that waited longer than
+	 * a period (of the block size) for a level */
+	uint32_t late_cycles () const { return _late; }
+
 	bool ready () const;
 	bool reset ();
 
+	/* Stop the background threads of an idle engine that is kept for
+	 * later use. The IR spectra are retained, reset() restarts it.
+	 */
+	void park ();
+	bool parked () const;
+
 private:
+	enum SuspendState {
+		Active,
+		Suspended, ///< engine is idle, buffers contain stale data
+		Flushed,   ///< engine is idle and can be resumed
+	};
+
+	void analyze_ir ();
+	void find_linked_channels ();
+	bool channel_settings_ok (IRSettings const&) const;
+
+	uint32_t matrix_outputs () const;
+
+	int      path_input (uint32_t c, uint32_t n_imp) const;
+	int      path_output (uint32_t c) const;
+	uint32_t path_delay (IRSettings const&, uint32_t c) const;
+
+	bool bypass ();
+	void run_bypass (float* const*, uint32_t n_chn, uint32_t, bool buffered);
+
 	void interpolate_gain ();
-	void output (float* dest, const float* src, uint32_t n) const;
+	void input (uint32_t i, float const* src, uint32_t n);
+	void output (float* dest, const float* src, uint32_t n, uint32_t o) const;
+
+	void process ();
+	void tailonly (uint32_t);
 
 	Readable*              _fs;
 	std::vector<Readable*> _readables;
+	std::vector<uint32_t>  _ir_start; ///< first audible sample per channel
+	std::vector<uint32_t>  _ir_end;   ///< end of audible part per channel
+	std::vector<uint32_t>  _ir_root;  ///< first channel with the same IR, up to a gain
+	std::vector<float>     _ir_scale; ///< gain relative to _ir_root
+
+	std::vector<int>      _path_io;    ///< engine path per IR channel (in * n_outputs + out), -1: none
+	std::vector<float>    _path_gain;  ///< gain of the IR channel when it was added
+	std::vector<uint32_t> _path_delay; ///< delay of the IR channel, after the input delay
 	Convproc               _convproc;
+	Convproc               _tail; ///< late part of the IR at a lower sample rate
 
 	std::string     _path;
 	IRChannelConfig _irc;
+	uint32_t        _n_in;  ///< Matrix inputs
+	uint32_t        _n_out; ///< Matrix outputs
 	int             _sched_policy;
 	int             _sched_priority;
 	double          _period_ns;
 	IRSettings      _ir_settings;
 
-	TimeDomainConvolver _tdc[4];
-	DelayLine           _dly[2];
+	std::vector<TimeDomainConvolver> _tdc; ///< per engine path
+	PreDelay            _pre[MAXCHN]; ///< common delay of all paths of an input
+	DelayLine           _dly[MAXCHN];
+	MultiRateFilter     _dec[MAXCHN];
+	MultiRateFilter     _int[MAXCHN];
+	std::vector<float>  _tail_lr[MAXCHN];  ///< low-rate tail output, one tail quantum
+	std::vector<float>  _tail_out[MAXCHN]; ///< tail output for the next cycle
 
 	uint32_t _samplerate;
 	uint32_t _n_samples;
 	uint32_t _max_size;
+	uint32_t _tail_ratio;   ///< decimation of the tail, 1: disabled
+	uint32_t _tail_quantum; ///< low-rate block-size of the tail engine
+	uint32_t _tail_pos;     ///< position in the current tail quantum
 	uint32_t _offset;
 	int32_t  _artificial_latency;
+	uint32_t _late;
 	bool     _configured;
+	bool     _enabled;
+	bool     _freewheel;
+
+	volatile SuspendState _suspend;
 
 	float _dry;
 	float _wet;
 	float _dry_target;
 	float _wet_target;
 	float _a;
+
+	/* gain changes since the IR was added, see apply_ir_settings() */
+	float _in_gain[MAXCHN];
+	float _out_gain[MAXCHN];
+	float _in_gain_target[MAXCHN];
+	float _out_gain_target[MAXCHN];
 };
 
 } /* namespace */
@@ -19,12 +19,15 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <pthread.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "convolver.h"
 
@@ -64,6 +67,21 @@
 #define ZC_chn_gain  ZC_PREFIX "channel_gain"
 #define ZC_chn_delay ZC_PREFIX "channel_predelay"
 #define ZC_sum_ins   ZC_PREFIX "sum_inputs"
+#define ZC_trim      ZC_PREFIX "trim_threshold"
+#define ZC_mtx_outs  ZC_PREFIX "matrix_outputs"
+#define ZC_lowrate   ZC_PREFIX "lowrate_tail"
+#define ZC_bank      ZC_PREFIX "bank"
+#define ZC_bank_ir   ZC_PREFIX "bank_ir" // 1 .. N_BANK
+#define ZC_xfade     ZC_PREFIX "crossfade"
+
+/* preloaded IRs, in addition to the one set by ZC_ir */
+#define N_BANK 8
+
+/* default of ZC_xfade [ms] */
+#define XFADE_MS 20.f
+
+/* audio ports of the Matrix variant, each direction */
+#define MAX_CHN ZeroConvoLV2::Convolver::MAXCHN
 
 #ifndef LV2_BUF_SIZE__nominalBlockLength
 # define LV2_BUF_SIZE__nominalBlockLength "http://lv2plug.in/ns/ext/buf-size#nominalBlockLength"
@@ -90,20 +108,105 @@ enum {
 	CMD_FREE  = 1,
 	CMD_INFO  = 2,
 	CMD_SWAP  = 3,
+	CMD_FLUSH = 4,
+	CMD_BANK  = 5,
+	CMD_DROP  = 6,
+	CMD_GAIN  = 7,
+	CMD_BANKS = 8,
+};
+
+/* worker message to clear a suspended engine */
+struct FlushCmd {
+	uint32_t                 cmd;
+	ZeroConvoLV2::Convolver* clv;
+};
+
+/* worker message to install (CMD_BANK) or free (CMD_DROP) the engine of a slot */
+struct BankCmd {
+	uint32_t                 cmd;
+	uint32_t                 slot;
+	ZeroConvoLV2::Convolver* clv;
+};
+
+/* worker message to apply gain and delay changes to the engine of a
+ * slot, see Convolver::prepare_ir_settings() */
+struct GainCmd {
+	uint32_t                          cmd;
+	uint32_t                          slot;
+	ZeroConvoLV2::Convolver*          clv;
+	ZeroConvoLV2::Convolver::IRUpdate upd;
+};
+
+/* worker message to load an IR file into a slot, atom type: zc_bank */
+struct BankLoad {
+	LV2_Atom atom;
+	uint32_t slot;
+	char     path[1025];
+};
+
+/* IR file and settings of a preset, see find_preset_irs() */
+struct PresetIR {
+	std::string                         path;
+	ZeroConvoLV2::Convolver::IRSettings irs;
+};
+
+/* Engines for the IRs of the bundle's presets, prepared ahead of time
+ * by an idle-priority thread, see prefetch_thread().
+ * Opt-in by setting $ZCONVOLV_PREFETCH to a memory budget in MiB.
+ */
+struct Prefetch {
+	Prefetch ()
+	{
+		running = false;
+		stop    = false;
+		budget  = used = 0;
+		pthread_mutex_init (&lock, NULL);
+	}
+
+	~Prefetch ()
+	{
+		pthread_mutex_destroy (&lock);
+	}
+
+	pthread_t     thread;
+	bool          running;
+	volatile bool stop;
+	uint32_t      block_size; ///< block size the engines were configured with
+	size_t        budget;     ///< bytes
+	size_t        used;       ///< bytes, protected by lock
+
+	std::vector<PresetIR>                 presets; ///< IR files and settings of the presets
+	std::vector<ZeroConvoLV2::Convolver*> clv;     ///< parked engines, protected by lock
+
+	pthread_mutex_t lock;
 };
 
 struct zeroConvolv {
 	zeroConvolv ()
 	{
-		input[0]    = input[1] = NULL;
-		output[0]   = output[1] = NULL;
-		p_latency   = NULL;
-		p_ctrl[0]   = p_ctrl[1] = p_ctrl [2] = p_ctrl [3] = NULL;
-		control     = NULL;
-		notify      = NULL;
-		clv_online  = clv_offline = NULL;
-		rt_policy   = rt_priority = 0;
-		in_restore  = false;
+		for (int c = 0; c < MAX_CHN; ++c) {
+			input[c]    = NULL;
+			output[c]   = NULL;
+			fade_buf[c] = NULL;
+		}
+		p_latency     = NULL;
+		p_freewheel   = NULL;
+		p_ctrl[0]     = p_ctrl[1] = p_ctrl [2] = p_ctrl [3] = NULL;
+		control       = NULL;
+		notify        = NULL;
+		clv_online    = clv_offline = NULL;
+		clv_fade      = NULL;
+		fade_drop     = NULL;
+		bank_sync     = false;
+		rt_policy     = rt_priority = 0;
+		in_restore    = false;
+		flush_pending = false;
+		slot_active   = slot_select = 0;
+		for (int i = 0; i <= N_BANK; ++i) {
+			clv_slot[i] = NULL;
+			bank_clv[i] = NULL;
+			slot_mem[i] = 0;
+		}
 	}
 
 	LV2_URID_Map*        map;
@@ -113,9 +216,10 @@ struct zeroConvolv {
 	LV2_Log_Logger logger;
 
 	/* ports */
-	float const* input[2];
-	float*       output[2];
+	float const* input[MAX_CHN];
+	float*       output[MAX_CHN];
 	float*       p_latency;
+	float const* p_freewheel;
 	float*       p_ctrl[4];
 
 	/* settings */
@@ -153,12 +257,35 @@ struct zeroConvolv {
 	LV2_URID zc_chn_gain;
 	LV2_URID zc_gain;
 	LV2_URID zc_sum_ins;
+	LV2_URID zc_trim;
+	LV2_URID zc_mtx_outs;
+	LV2_URID zc_lowrate;
 	LV2_URID zc_ir;
+	LV2_URID zc_bank;
+	LV2_URID zc_bank_ir[N_BANK];
+	LV2_URID zc_xfade;
 
-	ZeroConvoLV2::Convolver* clv_online;  ///< currently active engine
+	ZeroConvoLV2::Convolver* clv_online;  ///< currently active engine, clv_slot[slot_active]
 	ZeroConvoLV2::Convolver* clv_offline; ///< inactive engine being configured
-
-	bool pset_dirty; // unset before scheduling work for state-restore.
+	ZeroConvoLV2::Convolver* clv_fade;    ///< previously active engine, during crossfade
+	ZeroConvoLV2::Convolver* fade_drop;   ///< clv_fade was replaced in its slot, drop it after the crossfade
+
+	/* slot 0: IR set by ZC_ir, 1 .. N_BANK: preloaded IRs.
+	 * Engines are owned by the slots and only free()ed by the worker. */
+	ZeroConvoLV2::Convolver* clv_slot[N_BANK + 1];
+	uint32_t                 slot_active;
+	volatile uint32_t        slot_select;
+	size_t                   slot_mem[N_BANK + 1]; ///< engine memory, worker only
+
+	/* crossfade */
+	float*   fade_buf[MAX_CHN];
+	uint32_t fade_buf_len;
+	uint32_t fade_pos;
+	uint32_t fade_len;
+	float    fade_ms;
+
+	bool pset_dirty;    // unset before scheduling work for state-restore.
+	bool flush_pending; // a suspended engine is being flushed
 
 	pthread_mutex_t state_lock;
 	pthread_mutex_t queue_lock;
@@ -179,6 +306,19 @@ struct zeroConvolv {
 	std::string                         next_queued_file;
 	ZeroConvoLV2::Convolver::IRSettings next_queued_irs;
 	bool                                in_restore;
+
+	/* settings and files for IRs loaded into the bank by restore(),
+	 * see CMD_BANKS. Protected by queue_lock */
+	ZeroConvoLV2::Convolver::IRSettings bank_irs;
+	std::string                         bank_ir[N_BANK + 1];
+	bool                                bank_sync; ///< CMD_BANKS is scheduled
+
+	/* engine last loaded by the worker for each bank slot. It is only
+	 * deleted after it was replaced here, written by the worker with
+	 * queue_lock held. clv_slot[] is installed later, by work_response. */
+	ZeroConvoLV2::Convolver* bank_clv[N_BANK + 1];
+
+	Prefetch prefetch;
 };
 
 typedef struct {
@@ -193,6 +333,284 @@ typedef struct {
 static void  inform_ui (zeroConvolv* self, bool mark_dirty);
 static float db_to_coeff (float db);
 
+/* Collect the IR files and settings of the presets that apply to the
+ * given plugin, from the bundle's own presets.ttl.
+ *
+ * This is not a turtle parser, and deliberately limited to the file
+ * that the Makefile generates from the files in presets/: one preset per
+ * `a pset:Preset` line, followed by its lv2:appliesTo, and one state
+ * property per line. Only IR files inside the bundle are used. User
+ * presets and other bundles are not considered, the host loads those
+ * as usual. Channel gain and delay vectors are not read, those can be
+ * changed when the preset is recalled, see prefetch_take().
+ */
+static void
+find_preset_irs (const char* bundle_path, const char* uri, std::vector<PresetIR>& presets)
+{
+	std::string bundle (bundle_path ? bundle_path : "");
+	if (bundle.empty ()) {
+		return;
+	}
+	if (bundle[bundle.size () - 1] != '/') {
+		bundle += '/';
+	}
+
+	FILE* f = fopen ((bundle + "presets.ttl").c_str (), "r");
+	if (!f) {
+		return;
+	}
+
+	const std::string applies = std::string ("<") + uri + ">";
+
+	bool     match = false;
+	PresetIR p;
+	char     line[1024];
+
+	while (fgets (line, sizeof (line), f)) {
+		const std::string l (line);
+		const size_t      c = l.find_first_not_of (" \t");
+		if (c == std::string::npos || l[c] == '#') {
+			continue;
+		}
+		if (l.find ("a pset:Preset") != std::string::npos) {
+			match = false;
+			continue;
+		}
+		if (l.find ("lv2:appliesTo") != std::string::npos) {
+			match = l.find (applies) != std::string::npos;
+			p     = PresetIR ();
+			continue;
+		}
+		if (!match) {
+			continue;
+		}
+		if (l.compare (c, 2, "].") == 0) {
+			/* end of the preset's state */
+			bool dup = p.path.empty ();
+			for (std::vector<PresetIR>::const_iterator i = presets.begin (); i != presets.end () && !dup; ++i) {
+				dup = i->path == p.path && ZeroConvoLV2::Convolver::same_engine (i->irs, p.irs);
+			}
+			if (!dup) {
+				presets.push_back (p);
+			}
+			match = false;
+			continue;
+		}
+		if (l.compare (c, strlen (ZC_PREFIX) + 1, "<" ZC_PREFIX) != 0) {
+			continue;
+		}
+
+		/* <ZC_PREFIX key> value; */
+		const size_t ke = l.find ('>', c);
+		const size_t vs = ke == std::string::npos ? ke : l.find_first_not_of (" \t", ke + 1);
+		if (vs == std::string::npos) {
+			continue;
+		}
+		const std::string key = l.substr (c + 1 + strlen (ZC_PREFIX), ke - c - 1 - strlen (ZC_PREFIX));
+		const char*       val = l.c_str () + vs + (l[vs] == '"' ? 1 : 0);
+
+		if (key == "predelay") {
+			p.irs.pre_delay = atoi (val);
+		} else if (key == "artificial_latency") {
+			p.irs.artificial_latency = atoi (val);
+		} else if (key == "gain") {
+			p.irs.gain = atof (val);
+		} else if (key == "trim_threshold") {
+			p.irs.trim_threshold = atof (val);
+		} else if (key == "matrix_outputs") {
+			p.irs.matrix_outputs = atoi (val);
+		} else if (key == "sum_inputs") {
+			p.irs.sum_inputs = !strncmp (val, "true", 4);
+		} else if (key == "lowrate_tail") {
+			p.irs.lowrate_tail = !strncmp (val, "true", 4);
+		} else if (key == "ir" && l[vs] == '<') {
+			/* a relative path, i.e. a file in this bundle */
+			const size_t e = l.find ('>', vs);
+			if (e == std::string::npos || e == vs + 1 || l[vs + 1] == '/' || l.find (':', vs) < e) {
+				continue;
+			}
+			p.path = bundle + l.substr (vs + 1, e - vs - 1);
+		}
+	}
+	fclose (f);
+}
+
+/* memory of a parked engine, counted against the budget */
+static size_t
+prefetch_bytes (ZeroConvoLV2::Convolver const* clv)
+{
+	size_t   bytes, locked;
+	uint32_t count;
+	clv->memory_stats (bytes, locked, count);
+	return bytes + clv->data_bytes ();
+}
+
+/* true if the engine can be used for the given IR and settings */
+static bool
+prefetch_match (ZeroConvoLV2::Convolver const* clv, std::string const& ir_path, ZeroConvoLV2::Convolver::IRSettings const& irs)
+{
+	return clv->path () == ir_path && ZeroConvoLV2::Convolver::same_engine (clv->settings (), irs);
+}
+
+/* Park the engine and keep it, if it is for the IR and settings of a
+ * preset and fits the memory budget. Otherwise the engine is deleted.
+ * Called from the worker or the prefetch thread. */
+static bool
+prefetch_store (zeroConvolv* self, ZeroConvoLV2::Convolver* clv)
+{
+	Prefetch& pf = self->prefetch;
+
+	if (!clv) {
+		return false;
+	}
+
+	bool preset = false;
+	for (std::vector<PresetIR>::const_iterator i = pf.presets.begin (); i != pf.presets.end () && !preset; ++i) {
+		preset = prefetch_match (clv, i->path, i->irs);
+	}
+	if (pf.budget == 0 || !preset) {
+		delete clv;
+		return false;
+	}
+
+	const size_t bytes = prefetch_bytes (clv);
+
+	pthread_mutex_lock (&pf.lock);
+	bool ok = pf.used + bytes <= pf.budget;
+	for (std::vector<ZeroConvoLV2::Convolver*>::const_iterator i = pf.clv.begin (); ok && i != pf.clv.end (); ++i) {
+		ok = !prefetch_match (*i, clv->path (), clv->settings ());
+	}
+	if (ok) {
+		pf.used += bytes;
+	}
+	pthread_mutex_unlock (&pf.lock);
+
+	if (!ok) {
+		delete clv;
+		return false;
+	}
+
+	/* the engine is not yet visible to the worker. This stops
+	 * an engine that was in use, prefetched ones were not started */
+	clv->park ();
+
+	pthread_mutex_lock (&pf.lock);
+	pf.clv.push_back (clv);
+	pthread_mutex_unlock (&pf.lock);
+	return true;
+}
+
+/* Take a parked engine for the given IR, and restart it.
+ * Called from the worker with the state_lock held. */
+static ZeroConvoLV2::Convolver*
+prefetch_take (zeroConvolv* self, std::string const& ir_path, ZeroConvoLV2::Convolver::IRSettings const& irs)
+{
+	Prefetch& pf = self->prefetch;
+
+	ZeroConvoLV2::Convolver* clv = NULL;
+
+	pthread_mutex_lock (&pf.lock);
+	for (std::vector<ZeroConvoLV2::Convolver*>::iterator i = pf.clv.begin (); i != pf.clv.end (); ++i) {
+		/* only gain and delay can differ from the engine's settings */
+		if (prefetch_match (*i, ir_path, irs) && (*i)->set_ir_settings (irs)) {
+			clv = *i;
+			pf.clv.erase (i);
+			break;
+		}
+	}
+	if (clv) {
+		pf.used -= std::min (pf.used, prefetch_bytes (clv));
+	}
+	pthread_mutex_unlock (&pf.lock);
+
+	if (!clv) {
+		return NULL;
+	}
+
+	if (pf.block_size != self->block_size) {
+		clv->reconfigure (self->block_size);
+	} else {
+		clv->reset ();
+	}
+	return clv;
+}
+
+static void*
+prefetch_thread (void* arg)
+{
+	zeroConvolv* self = (zeroConvolv*)arg;
+	Prefetch&    pf   = self->prefetch;
+
+#ifdef SCHED_IDLE
+	struct sched_param parm;
+	parm.sched_priority = 0;
+	pthread_setschedparam (pthread_self (), SCHED_IDLE, &parm);
+#endif
+
+	for (std::vector<PresetIR>::const_iterator i = pf.presets.begin (); i != pf.presets.end () && !pf.stop; ++i) {
+		ZeroConvoLV2::Convolver* clv = NULL;
+		try {
+			clv = new ZeroConvoLV2::Convolver (i->path, self->rate, self->rt_policy, self->rt_priority, self->chn_cfg, i->irs, self->chn_in, self->chn_out);
+			/* do not start the threads of an engine that may never be used */
+			clv->reconfigure (pf.block_size, true, false);
+		} catch (std::runtime_error& err) {
+			lv2_log_warning (&self->logger, "ZConvolv Prefetch: %s.\n", err.what ());
+			delete clv;
+			continue;
+		}
+		if (!clv->parked ()) {
+			delete clv;
+			continue;
+		}
+		if (!prefetch_store (self, clv)) {
+			/* over budget, or the IR is already cached */
+			continue;
+		}
+	}
+
+	pthread_mutex_lock (&pf.lock);
+	lv2_log_note (&self->logger, "ZConvolv: prefetched %u of %u preset IRs, %.1f MiB\n",
+	              (unsigned int)pf.clv.size (), (unsigned int)pf.presets.size (), pf.used / 1048576.0);
+	pthread_mutex_unlock (&pf.lock);
+	return NULL;
+}
+
+static void
+prefetch_start (zeroConvolv* self, const LV2_Descriptor* descriptor, const char* bundle_path)
+{
+	Prefetch&   pf  = self->prefetch;
+	const char* env = getenv ("ZCONVOLV_PREFETCH");
+
+	if (!env || atof (env) <= 0) {
+		return;
+	}
+
+	find_preset_irs (bundle_path, descriptor->URI, pf.presets);
+	if (pf.presets.empty ()) {
+		return;
+	}
+
+	pf.budget     = atof (env) * 1048576.0;
+	pf.block_size = self->block_size;
+	pf.running    = 0 == pthread_create (&pf.thread, NULL, prefetch_thread, self);
+}
+
+static void
+prefetch_cleanup (zeroConvolv* self)
+{
+	Prefetch& pf = self->prefetch;
+	if (pf.running) {
+		pf.stop = true;
+		pthread_join (pf.thread, NULL);
+		pf.running = false;
+	}
+	for (std::vector<ZeroConvoLV2::Convolver*>::const_iterator i = pf.clv.begin (); i != pf.clv.end (); ++i) {
+		delete *i;
+	}
+	pf.clv.clear ();
+	pf.used = 0;
+}
+
 static LV2_Handle
 instantiate (const LV2_Descriptor*     descriptor,
              double                    rate,
@@ -333,6 +751,10 @@ instantiate (const LV2_Descriptor*     descriptor,
 		self->chn_in  = 1;
 		self->chn_out = 2;
 		self->chn_cfg = ZeroConvoLV2::Convolver::MonoToStereo;
+	} else if (!strcmp (descriptor->URI, ZC_PREFIX "Matrix")) {
+		self->chn_in  = MAX_CHN;
+		self->chn_out = MAX_CHN;
+		self->chn_cfg = ZeroConvoLV2::Convolver::Matrix;
 	} else {
 		lv2_log_error (&logger, "ZConvolv: Invalid URI\n");
 		delete self;
@@ -358,6 +780,18 @@ instantiate (const LV2_Descriptor*     descriptor,
 	self->tc64        = 2950.f / rate; // ~20Hz for 90%
 	self->pset_dirty  = true;
 
+	self->fade_ms      = XFADE_MS;
+	self->fade_len     = self->fade_ms * rate / 1000.f;
+	self->fade_pos     = 0;
+	self->fade_buf_len = std::max (block_size, max_block);
+	for (int c = 0; c < std::max (2, self->chn_out); ++c) {
+		self->fade_buf[c] = (float*)calloc (self->fade_buf_len, sizeof (float));
+		if (!self->fade_buf[c]) {
+			/* no crossfade */
+			self->fade_buf_len = 0;
+		}
+	}
+
 	lv2_atom_forge_init (&self->forge, map);
 
 	self->atom_Blank     = map->map (map->handle, LV2_ATOM__Blank);
@@ -381,7 +815,24 @@ instantiate (const LV2_Descriptor*     descriptor,
 	self->zc_chn_gain    = map->map (map->handle, ZC_chn_gain);
 	self->zc_gain        = map->map (map->handle, ZC_gain);
 	self->zc_sum_ins     = map->map (map->handle, ZC_sum_ins);
+	self->zc_trim        = map->map (map->handle, ZC_trim);
+	self->zc_mtx_outs    = map->map (map->handle, ZC_mtx_outs);
+	self->zc_lowrate     = map->map (map->handle, ZC_lowrate);
 	self->zc_ir          = map->map (map->handle, ZC_ir);
+	self->zc_bank        = map->map (map->handle, ZC_bank);
+	self->zc_xfade       = map->map (map->handle, ZC_xfade);
+
+	for (int i = 0; i < N_BANK; ++i) {
+		char uri[64];
+		snprintf (uri, sizeof (uri), ZC_bank_ir "%d", i + 1);
+		self->zc_bank_ir[i] = map->map (map->handle, uri);
+	}
+
+	if (!strncmp (descriptor->URI, ZC_PREFIX "Cfg", strlen (ZC_PREFIX "Cfg"))) {
+		/* IRs are loaded by the user */
+	} else {
+		prefetch_start (self, descriptor, bundle_path);
+	}
 
 #ifdef WITH_STATIC_FFTW_CLEANUP
 	pthread_mutex_lock (&instance_count_lock);
@@ -399,24 +850,18 @@ connect_port (LV2_Handle instance,
 {
 	zeroConvolv* self = (zeroConvolv*)instance;
 
-	switch (port) {
-		case 0:
-			self->p_latency = (float*)data;
-			break;
-		case 1:
-			self->output[0] = (float*)data;
-			break;
-		case 3:
-			self->output[1] = (float*)data;
-			break;
-		case 2:
-			self->input[0] = (const float*)data;
-			break;
-		case 4:
-			self->input[1] = (const float*)data;
-			break;
-		default:
-			break;
+	/* latency, then pairs of output and input ports,
+	 * and finally the (optional) lv2:freeWheeling port */
+	if (port == 0) {
+		self->p_latency = (float*)data;
+	} else if (port == (uint32_t)(1 + self->chn_in + self->chn_out)) {
+		self->p_freewheel = (const float*)data;
+	} else if (port <= 2 * MAX_CHN) {
+		if (port & 1) {
+			self->output[(port - 1) / 2] = (float*)data;
+		} else {
+			self->input[(port - 1) / 2] = (const float*)data;
+		}
 	}
 }
 
@@ -424,9 +869,16 @@ static void
 activate (LV2_Handle instance)
 {
 	zeroConvolv* self = (zeroConvolv*)instance;
-	if (self->clv_online) {
-		self->clv_online->reset ();
+	for (int i = 0; i <= N_BANK; ++i) {
+		if (self->clv_slot[i]) {
+			self->clv_slot[i]->reset ();
+		}
 	}
+	/* not processing, an engine that was replaced in its slot can
+	 * be deleted right away */
+	delete self->fade_drop;
+	self->fade_drop = NULL;
+	self->clv_fade  = NULL;
 }
 
 static inline void
@@ -438,66 +890,207 @@ copy_no_inplace_buffers (float* out, float const* in, uint32_t n_samples)
 	memcpy (out, in, sizeof (float) * n_samples);
 }
 
+/* process in-place, out[] holds the input signal */
 static void
-run (LV2_Handle instance, uint32_t n_samples)
+run_engine (zeroConvolv* self, ZeroConvoLV2::Convolver* clv, float** out, uint32_t n_samples)
 {
-	zeroConvolv* self = (zeroConvolv*)instance;
-
-	if (!self->clv_online) {
-		*self->p_latency = 0;
-		for (int i = 0; i < self->chn_out; i++) {
-			memset (self->output[i], 0, sizeof (float) * n_samples);
-		}
-		return;
-	}
-
 	const bool buffered = self->buffered;
 
-	assert (self->clv_online->ready ());
-	*self->p_latency = self->clv_online->artificial_latency () + (buffered ? self->clv_online->latency () : 0);
+	assert (clv->ready ());
 
-	copy_no_inplace_buffers (self->output[0], self->input[0], n_samples);
+	/* while exporting, do not wait for the engine's threads. Without
+	 * a connected lv2:freeWheeling port the host is not freewheeling */
+	clv->set_freewheel (self->p_freewheel && *self->p_freewheel > 0.f);
 
-	if (self->chn_in == 2) {
+	if (self->chn_cfg == ZeroConvoLV2::Convolver::Matrix) {
+		/* the preset variant is always buffered */
+		assert (buffered);
+		clv->run_buffered_multi (out, n_samples);
+	} else if (self->chn_in == 2) {
 		assert (self->chn_out == 2);
-		if (self->clv_online->sum_inputs ()) {
-			/* fake stereo, sum inputs to mono */
+		if (clv->sum_inputs ()) {
+			/* fake stereo, sum inputs to mono. The Convolver only
+			 * reads the left channel, the right one is the dry signal */
 			for (uint32_t i = 0; i < n_samples; ++i) {
-				self->output[0][i] = 0.5 * (self->output[0][i] + self->input[1][i]);
+				out[0][i] = 0.5 * (out[0][i] + out[1][i]);
 			}
-			memcpy (self->output[1], self->output[0], sizeof (float) * n_samples);
-		} else {
-			copy_no_inplace_buffers (self->output[1], self->input[1], n_samples);
+			memcpy (out[1], out[0], sizeof (float) * n_samples);
 		}
 		if (buffered) {
-			self->clv_online->run_buffered_stereo (self->output[0], self->output[1], n_samples);
+			clv->run_buffered_stereo (out[0], out[1], n_samples);
 		} else {
-			self->clv_online->run_stereo (self->output[0], self->output[1], n_samples);
+			clv->run_stereo (out[0], out[1], n_samples);
 		}
 	} else if (self->chn_out == 2) {
 		assert (self->chn_in == 1);
+		/* dry signal */
+		copy_no_inplace_buffers (out[1], out[0], n_samples);
 		if (buffered) {
-			self->clv_online->run_buffered_stereo (self->output[0], self->output[1], n_samples);
+			clv->run_buffered_stereo (out[0], out[1], n_samples);
 		} else {
-			self->clv_online->run_stereo (self->output[0], self->output[1], n_samples);
+			clv->run_stereo (out[0], out[1], n_samples);
 		}
 	} else {
 		assert (self->chn_in == 1);
 		assert (self->chn_out == 1);
 		if (buffered) {
-			self->clv_online->run_buffered_mono (self->output[0], n_samples);
+			clv->run_buffered_mono (out[0], n_samples);
+		} else {
+			clv->run_mono (out[0], n_samples);
+		}
+	}
+}
+
+/* make the selected slot active */
+static void
+select_slot (zeroConvolv* self)
+{
+	const uint32_t slot = self->slot_select;
+	if (slot == self->slot_active || self->clv_fade) {
+		return;
+	}
+
+	ZeroConvoLV2::Convolver* next = self->clv_slot[slot];
+	if (!next) {
+		/* not yet loaded */
+		return;
+	}
+
+	if (next->suspended ()) {
+		/* previously active, clear stale buffers first */
+		if (!self->flush_pending) {
+			FlushCmd fc = { CMD_FLUSH, next };
+			self->flush_pending = LV2_WORKER_SUCCESS == self->schedule->schedule_work (self->schedule->handle, sizeof (FlushCmd), &fc);
+		}
+		return;
+	}
+
+	next->set_output_gain (db_to_coeff (self->db_dry), db_to_coeff (self->db_wet), false);
+
+	/* The new engine is faded in once its dry signal delay-line
+	 * has been filled, see crossfade() */
+	if (self->clv_online && self->fade_buf_len > 0) {
+		self->clv_fade = self->clv_online;
+		self->fade_pos = 0;
+	}
+
+	self->clv_online  = next;
+	self->slot_active = slot;
+}
+
+/* mix the output of the previous engine, given in fade_buf,
+ * with the output of the active engine. */
+static void
+crossfade (zeroConvolv* self, uint32_t offset, uint32_t n_samples)
+{
+	const uint32_t pre = self->buffered ? self->clv_online->latency () : 0;
+	const uint32_t len = self->fade_len;
+
+	for (uint32_t i = 0; i < n_samples; ++i, ++self->fade_pos) {
+		float g;
+		if (self->fade_pos < pre) {
+			g = 0.f;
+		} else if (self->fade_pos < pre + len) {
+			g = (self->fade_pos - pre) / (float)len;
 		} else {
-			self->clv_online->run_mono (self->output[0], n_samples);
+			g = 1.f;
+		}
+		for (int c = 0; c < self->chn_out; ++c) {
+			float* out = &self->output[c][offset];
+			out[i]     = g * out[i] + (1.f - g) * self->fade_buf[c][i];
 		}
 	}
+
+	if (self->fade_pos < pre + len) {
+		return;
+	}
+
+	if (self->clv_fade == self->fade_drop) {
+		/* the previous engine was replaced in its slot meanwhile */
+		BankCmd d = { CMD_DROP, 0, self->fade_drop };
+		self->schedule->schedule_work (self->schedule->handle, sizeof (BankCmd), &d);
+		self->fade_drop = NULL;
+		self->clv_fade  = NULL;
+		return;
+	}
+
+	/* crossfade is complete, flush the previous engine, so that
+	 * it can be used again */
+	self->clv_fade->suspend ();
+	if (!self->flush_pending) {
+		FlushCmd fc = { CMD_FLUSH, self->clv_fade };
+		self->flush_pending = LV2_WORKER_SUCCESS == self->schedule->schedule_work (self->schedule->handle, sizeof (FlushCmd), &fc);
+	}
+	self->clv_fade = NULL;
+}
+
+static void
+run (LV2_Handle instance, uint32_t n_samples)
+{
+	zeroConvolv* self = (zeroConvolv*)instance;
+
+	select_slot (self);
+
+	if (!self->clv_online) {
+		*self->p_latency = 0;
+		for (int i = 0; i < self->chn_out; i++) {
+			memset (self->output[i], 0, sizeof (float) * n_samples);
+		}
+		return;
+	}
+
+	*self->p_latency = self->clv_online->artificial_latency () + (self->buffered ? self->clv_online->latency () : 0);
+
+	uint32_t done   = 0;
+	uint32_t remain = n_samples;
+
+	while (remain > 0) {
+		uint32_t ns = self->clv_fade ? std::min (remain, self->fade_buf_len) : remain;
+
+		float const* in[MAX_CHN];
+		float*       out[MAX_CHN];
+		for (int c = 0; c < self->chn_in; ++c) {
+			in[c] = &self->input[c][done];
+		}
+		for (int c = 0; c < self->chn_out; ++c) {
+			out[c] = &self->output[c][done];
+		}
+
+		if (self->clv_fade) {
+			for (int c = 0; c < self->chn_in; ++c) {
+				memcpy (self->fade_buf[c], in[c], sizeof (float) * ns);
+			}
+		}
+
+		for (int c = 0; c < self->chn_in; ++c) {
+			copy_no_inplace_buffers (out[c], in[c], ns);
+		}
+
+		run_engine (self, self->clv_online, out, ns);
+
+		if (self->clv_fade) {
+			run_engine (self, self->clv_fade, self->fade_buf, ns);
+			crossfade (self, done, ns);
+		}
+
+		done   += ns;
+		remain -= ns;
+	}
 }
 
 static void
 cleanup (LV2_Handle instance)
 {
 	zeroConvolv* self = (zeroConvolv*)instance;
-	delete self->clv_online;
+	prefetch_cleanup (self);
+	for (int i = 0; i <= N_BANK; ++i) {
+		delete self->clv_slot[i];
+	}
 	delete self->clv_offline;
+	delete self->fade_drop;
+	for (int c = 0; c < MAX_CHN; ++c) {
+		free (self->fade_buf[c]);
+	}
 	pthread_mutex_destroy (&self->queue_lock);
 	pthread_mutex_destroy (&self->state_lock);
 
@@ -532,6 +1125,51 @@ work_response (LV2_Handle  instance,
 {
 	zeroConvolv* self = (zeroConvolv*)instance;
 
+	if (size == sizeof (FlushCmd) && *((const uint32_t*)data) == CMD_FLUSH) {
+		/* the engine may have been replaced in the meantime */
+		ZeroConvoLV2::Convolver* clv = ((const FlushCmd*)data)->clv;
+		for (int i = 0; i <= N_BANK; ++i) {
+			if (clv == self->clv_slot[i] && clv != self->clv_fade) {
+				clv->flush_done ();
+			}
+		}
+		self->flush_pending = false;
+		return LV2_WORKER_SUCCESS;
+	}
+
+	if (size == sizeof (BankCmd) && *((const uint32_t*)data) == CMD_BANK) {
+		const BankCmd* bc = (const BankCmd*)data;
+		assert (bc->slot > 0 && bc->slot <= N_BANK);
+
+		ZeroConvoLV2::Convolver* old = self->clv_slot[bc->slot];
+		self->clv_slot[bc->slot]     = bc->clv;
+
+		if (bc->clv) {
+			bc->clv->set_output_gain (db_to_coeff (self->db_dry), db_to_coeff (self->db_wet), false);
+		}
+		if (bc->slot == self->slot_active) {
+			self->clv_online = bc->clv;
+		}
+		if (old && old == self->clv_fade) {
+			/* keep fading it out, see crossfade() */
+			self->fade_drop = old;
+		} else if (old) {
+			BankCmd d = { CMD_DROP, bc->slot, old };
+			self->schedule->schedule_work (self->schedule->handle, sizeof (BankCmd), &d);
+		}
+		inform_ui (self, false);
+		return LV2_WORKER_SUCCESS;
+	}
+
+	if (size == sizeof (GainCmd) && *((const uint32_t*)data) == CMD_GAIN) {
+		/* the engine may have been replaced in the meantime */
+		const GainCmd* gc = (const GainCmd*)data;
+		if (gc->slot <= N_BANK && gc->clv == self->clv_slot[gc->slot]) {
+			gc->clv->apply_ir_settings (gc->upd);
+		}
+		return LV2_WORKER_SUCCESS;
+	}
+
 	if (size == sizeof (uint32_t) && *((const uint32_t*)data) == CMD_INFO) {
 		if (self->clv_online) {
 			inform_ui (self, self->pset_dirty);
@@ -553,15 +1191,22 @@ work_response (LV2_Handle  instance,
 	}
 
 	/* swap engine instances */
-	ZeroConvoLV2::Convolver* old = self->clv_online;
+	ZeroConvoLV2::Convolver* old = self->clv_slot[0];
 
-	self->clv_online  = self->clv_offline;
+	self->clv_slot[0] = self->clv_offline;
 	self->clv_offline = old;
 
 	/* set gain coefficients for new instance */
-	self->clv_online->set_output_gain (db_to_coeff (self->db_dry), db_to_coeff (self->db_wet), false);
+	self->clv_slot[0]->set_output_gain (db_to_coeff (self->db_dry), db_to_coeff (self->db_wet), false);
 
-	assert (self->clv_online != self->clv_offline || self->clv_online == NULL);
+	if (self->slot_active == 0) {
+		self->clv_online = self->clv_slot[0];
+	}
+	if (old && old == self->clv_fade) {
+		self->clv_fade = NULL;
+	}
+
+	assert (self->clv_slot[0] != self->clv_offline || self->clv_slot[0] == NULL);
 
 	uint32_t d = CMD_FREE;
 	self->schedule->schedule_work (self->schedule->handle, sizeof (uint32_t), &d);
@@ -580,6 +1225,17 @@ set_queue (zeroConvolv* self, std::string const& ir_path, ZeroConvoLV2::Convolve
 	pthread_mutex_unlock (&self->queue_lock);
 }
 
+/* the engine runs even if mlock() failed, it is only more
+ * susceptible to page-faults. Say why, see RLIMIT_MEMLOCK */
+static void
+check_memlock (zeroConvolv* self, size_t mem_size, size_t mem_lock)
+{
+	if (ZeroConvoLV2::Convolver::memlock () && mem_lock < mem_size) {
+		lv2_log_warning (&self->logger, "ZConvolv: could only lock %.1f of %.1f MiB engine memory, check the memlock limit (ulimit -l)\n",
+		                 mem_lock / 1048576.0, mem_size / 1048576.0);
+	}
+}
+
 static LV2_Worker_Status
 load_ir_worker_locked (zeroConvolv*                        self,
                        LV2_Worker_Respond_Function         respond,
@@ -590,6 +1246,13 @@ load_ir_worker_locked (zeroConvolv*                        self,
 {
 	ok = false;
 
+	uint32_t ir_len   = 0;
+	uint32_t ir_start = 0;
+	uint32_t ir_end   = 0;
+	uint32_t mem_cnt  = 0;
+	size_t   mem_size = 0;
+	size_t   mem_lock = 0;
+
 	if (self->clv_offline) {
 		set_queue (self, ir_path, irs);
 		pthread_mutex_unlock (&self->state_lock);
@@ -601,11 +1264,19 @@ load_ir_worker_locked (zeroConvolv*                        self,
 #endif
 
 	try {
-		self->clv_offline = new ZeroConvoLV2::Convolver (ir_path, self->rate, self->rt_policy, self->rt_priority, self->chn_cfg, irs);
-		self->clv_offline->reconfigure (self->block_size);
+		self->clv_offline = prefetch_take (self, ir_path, irs);
+		if (!self->clv_offline) {
+			self->clv_offline = new ZeroConvoLV2::Convolver (ir_path, self->rate, self->rt_policy, self->rt_priority, self->chn_cfg, irs, self->chn_in, self->chn_out);
+			self->clv_offline->reconfigure (self->block_size);
+		}
 		if (!(ok = self->clv_offline->ready ())) {
 			delete self->clv_offline;
 			self->clv_offline = NULL;
+		} else {
+			ir_len   = self->clv_offline->ir_length ();
+			ir_start = self->clv_offline->ir_start ();
+			ir_end   = self->clv_offline->ir_end ();
+			self->clv_offline->memory_stats (mem_size, mem_lock, mem_cnt);
 		}
 	} catch (std::runtime_error& err) {
 		lv2_log_warning (&self->logger, "ZConvolv Convolver: %s.\n", err.what ());
@@ -627,6 +1298,11 @@ load_ir_worker_locked (zeroConvolv*                        self,
 		lv2_log_warning (&self->logger, "ZConvolv Load: configuration failed for ir '%s'.\n", ir_path.c_str ());
 		return LV2_WORKER_ERR_UNKNOWN;
 	}
+	if (ir_start > 0 || ir_end < ir_len) {
+		lv2_log_note (&self->logger, "ZConvolv: trimmed IR from %u to %u samples (start: %u, end: %u)\n", ir_len, ir_end - ir_start, ir_start, ir_end);
+	}
+	lv2_log_note (&self->logger, "ZConvolv: engine memory %.1f MiB in %u allocations, %.1f MiB locked\n", mem_size / 1048576.0, mem_cnt, mem_lock / 1048576.0);
+	check_memlock (self, mem_size, mem_lock);
 	return LV2_WORKER_SUCCESS;
 }
 
@@ -642,6 +1318,97 @@ load_ir_worker (zeroConvolv*                        self,
 	return load_ir_worker_locked (self, respond, handle, ir_path, irs, ok);
 }
 
+static bool
+schedule_bank_load (zeroConvolv* self, LV2_Worker_Schedule* schedule, uint32_t slot, const char* path, size_t len)
+{
+	BankLoad bl;
+	if (len >= sizeof (bl.path)) {
+		return false;
+	}
+	bl.atom.type = self->zc_bank;
+	bl.atom.size = sizeof (uint32_t) + len + 1;
+	bl.slot      = slot;
+	memcpy (bl.path, path, len);
+	bl.path[len] = '\0';
+	return LV2_WORKER_SUCCESS == schedule->schedule_work (schedule->handle, lv2_atom_total_size (&bl.atom), &bl);
+}
+
+static LV2_Worker_Status
+load_bank_worker (zeroConvolv*                self,
+                  LV2_Worker_Respond_Function respond,
+                  LV2_Worker_Respond_Handle   handle,
+                  uint32_t                    slot,
+                  std::string const&          ir_path)
+{
+	BankCmd bc = { CMD_BANK, slot, NULL };
+
+	uint32_t mem_cnt  = 0;
+	size_t   mem_size = 0;
+	size_t   mem_lock = 0;
+
+	pthread_mutex_lock (&self->queue_lock);
+	ZeroConvoLV2::Convolver::IRSettings irs = self->bank_irs;
+	pthread_mutex_unlock (&self->queue_lock);
+
+	/* the engine is alive, CMD_DROP for it cannot be scheduled before
+	 * another engine was loaded for the slot */
+	ZeroConvoLV2::Convolver* clv = self->bank_clv[slot];
+	if (ir_path.empty () && !clv) {
+		/* the slot is empty */
+		return LV2_WORKER_SUCCESS;
+	}
+
+	GainCmd gc;
+	if (!ir_path.empty () && clv && clv->path () == ir_path && clv->prepare_ir_settings (irs, gc.upd)) {
+		/* the slot already holds the IR, the engine may be processing */
+		gc.cmd  = CMD_GAIN;
+		gc.slot = slot;
+		gc.clv  = clv;
+		respond (handle, sizeof (GainCmd), &gc);
+		return LV2_WORKER_SUCCESS;
+	}
+
+	if (!ir_path.empty ()) {
+		try {
+			bc.clv = new ZeroConvoLV2::Convolver (ir_path, self->rate, self->rt_policy, self->rt_priority, self->chn_cfg, irs, self->chn_in, self->chn_out);
+			bc.clv->reconfigure (self->block_size);
+			if (!bc.clv->ready ()) {
+				delete bc.clv;
+				bc.clv = NULL;
+			} else {
+				bc.clv->memory_stats (mem_size, mem_lock, mem_cnt);
+			}
+		} catch (std::runtime_error& err) {
+			lv2_log_warning (&self->logger, "ZConvolv Convolver: %s.\n", err.what ());
+			bc.clv = NULL;
+		}
+
+		if (!bc.clv) {
+			/* keep the IR that was loaded before */
+			lv2_log_warning (&self->logger, "ZConvolv Bank: configuration failed for ir '%s'.\n", ir_path.c_str ());
+			return LV2_WORKER_ERR_UNKNOWN;
+		}
+	}
+
+	pthread_mutex_lock (&self->queue_lock);
+	self->bank_clv[slot] = bc.clv;
+	pthread_mutex_unlock (&self->queue_lock);
+
+	self->slot_mem[slot] = mem_size;
+
+	size_t total = 0;
+	for (int i = 1; i <= N_BANK; ++i) {
+		total += self->slot_mem[i];
+	}
+
+	lv2_log_note (&self->logger, "ZConvolv: bank slot %u engine memory %.1f MiB, %.1f MiB locked, bank total %.1f MiB\n",
+	              slot, mem_size / 1048576.0, mem_lock / 1048576.0, total / 1048576.0);
+	check_memlock (self, mem_size, mem_lock);
+
+	respond (handle, sizeof (BankCmd), &bc);
+	return LV2_WORKER_SUCCESS;
+}
+
 static LV2_Worker_Status
 work (LV2_Handle                  instance,
       LV2_Worker_Respond_Function respond,
@@ -652,15 +1419,49 @@ work (LV2_Handle                  instance,
 	zeroConvolv* self = (zeroConvolv*)instance;
 	bool         unused;
 
+	if (size == sizeof (FlushCmd) && *((const uint32_t*)data) == CMD_FLUSH) {
+		/* Convolver instances are only free()ed by the worker (CMD_FREE),
+		 * which is scheduled after the engine was taken offline. */
+		((const FlushCmd*)data)->clv->flush ();
+		respond (handle, size, data);
+		return LV2_WORKER_SUCCESS;
+	}
+
+	if (size == sizeof (BankCmd) && *((const uint32_t*)data) == CMD_DROP) {
+		/* the engine was replaced in the slot */
+		delete ((const BankCmd*)data)->clv;
+		return LV2_WORKER_SUCCESS;
+	}
+
+	if (size == sizeof (GainCmd) && *((const uint32_t*)data) == CMD_GAIN) {
+		/* prepared by restore(), apply it in run() */
+		respond (handle, size, data);
+		return LV2_WORKER_SUCCESS;
+	}
+
 	if (size == sizeof (uint32_t)) {
 		switch (*((const uint32_t*)data)) {
 			case CMD_APPLY:
 				respond (handle, 1, "");
 				break;
+			case CMD_BANKS:
+				/* load the bank of the most recent restore(). Slots
+				 * that already hold the file are kept */
+				pthread_mutex_lock (&self->queue_lock);
+				self->bank_sync = false;
+				pthread_mutex_unlock (&self->queue_lock);
+				for (uint32_t i = 1; i <= N_BANK; ++i) {
+					pthread_mutex_lock (&self->queue_lock);
+					std::string ir_path = self->bank_ir[i];
+					pthread_mutex_unlock (&self->queue_lock);
+					load_bank_worker (self, respond, handle, i, ir_path);
+				}
+				break;
 			case CMD_FREE:
 				{
 					pthread_mutex_lock (&self->state_lock);
-					delete self->clv_offline;
+					/* keep the engine of a preset for later recall */
+					prefetch_store (self, self->clv_offline);
 					self->clv_offline = NULL;
 
 					pthread_mutex_lock (&self->queue_lock);
@@ -692,7 +1493,14 @@ work (LV2_Handle                  instance,
 	size_t const irssize = sizeof (ZeroConvoLV2::Convolver::IRSettings);
 
 	const LV2_Atom* a = (const LV2_Atom*)data;
-	if (a->type == self->atom_String) {
+	if (a->type == self->zc_bank && a->size > sizeof (uint32_t) && a->size <= sizeof (BankLoad) - sizeof (LV2_Atom)) {
+		const BankLoad* bl = (const BankLoad*)data;
+		if (bl->slot < 1 || bl->slot > N_BANK) {
+			return LV2_WORKER_ERR_UNKNOWN;
+		}
+		fn = std::string (bl->path, strnlen (bl->path, a->size - sizeof (uint32_t)));
+		return load_bank_worker (self, respond, handle, bl->slot, fn);
+	} else if (a->type == self->atom_String) {
 		fn = std::string ((const char*)(a + 1), a->size);
 	} else if (a->type == self->atom_Path) {
 		fn = std::string ((const char*)(a + 1), a->size);
@@ -707,6 +1515,13 @@ work (LV2_Handle                  instance,
 	return load_ir_worker (self, respond, handle, fn, irs, unused);
 }
 
+static void
+set_crossfade (zeroConvolv* self, float ms)
+{
+	self->fade_ms  = std::max (0.f, std::min (ms, 1000.f));
+	self->fade_len = self->fade_ms * self->rate / 1000.f;
+}
+
 static LV2_State_Status
 save (LV2_Handle                instance,
       LV2_State_Store_Function  store,
@@ -735,29 +1550,70 @@ save (LV2_Handle                instance,
 	if (!map_path) {
 		return LV2_STATE_ERR_NO_FEATURE;
 	}
-	if (!self->clv_online) {
-		/* no state to save */
-		return LV2_STATE_SUCCESS;
-	}
 
-	char* apath = map_path->abstract_path (map_path->handle, self->clv_online->path ().c_str ());
-	store (handle, self->zc_ir, apath, strlen (apath) + 1, self->atom_Path, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	for (int i = 0; i <= N_BANK; ++i) {
+		std::string path;
+		if (i == 0) {
+			if (!self->clv_slot[0]) {
+				continue;
+			}
+			path = self->clv_slot[0]->path ();
+		} else {
+			/* bank engines in clv_slot[] can be replaced and deleted
+			 * meanwhile, see load_bank_worker() */
+			pthread_mutex_lock (&self->queue_lock);
+			if (self->bank_clv[i]) {
+				path = self->bank_clv[i]->path ();
+			}
+			pthread_mutex_unlock (&self->queue_lock);
+			if (path.empty ()) {
+				continue;
+			}
+		}
+		char* apath = map_path->abstract_path (map_path->handle, path.c_str ());
+		store (handle, i == 0 ? self->zc_ir : self->zc_bank_ir[i - 1], apath, strlen (apath) + 1, self->atom_Path, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
 #ifdef LV2_STATE__freePath
-	if (free_path) {
-		free_path->free_path (free_path->handle, apath);
-	} else
+		if (free_path) {
+			free_path->free_path (free_path->handle, apath);
+		} else
 #endif
-	{
+		{
 #ifndef _WIN32 // https://github.com/drobilla/lilv/issues/14
-		free (apath);
+			free (apath);
 #endif
+		}
 	}
 
-	ZeroConvoLV2::Convolver::IRSettings const& irs (self->clv_online->settings ());
+	/* restore() falls back to the defaults */
+	int32_t slot = self->slot_select;
+	if (slot != 0) {
+		store (handle, self->zc_bank, &slot, sizeof (int32_t), self->atom_Int,
+		       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	}
+
+	if (self->fade_ms != XFADE_MS) {
+		store (handle, self->zc_xfade, &self->fade_ms, sizeof (float), self->atom_Float,
+		       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	}
+
+	if (!self->clv_slot[0]) {
+		/* no IR settings to save */
+		return LV2_STATE_SUCCESS;
+	}
+
+	ZeroConvoLV2::Convolver::IRSettings const& irs (self->clv_slot[0]->settings ());
 
 	store (handle, self->zc_gain, &irs.gain, sizeof (float), self->atom_Float,
 	       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
 
+	store (handle, self->zc_trim, &irs.trim_threshold, sizeof (float), self->atom_Float,
+	       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+
+	if (self->chn_cfg == ZeroConvoLV2::Convolver::Matrix) {
+		store (handle, self->zc_mtx_outs, &irs.matrix_outputs, sizeof (int32_t), self->atom_Int,
+		       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	}
+
 	store (handle, self->zc_predelay, &irs.pre_delay, sizeof (int32_t), self->atom_Int,
 	       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
 
@@ -768,6 +1624,10 @@ save (LV2_Handle                instance,
 	store (handle, self->zc_sum_ins, &lv2bool, sizeof (int32_t), self->atom_Bool,
 	       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
 
+	lv2bool = irs.lowrate_tail ? 1 : 0;
+	store (handle, self->zc_lowrate, &lv2bool, sizeof (int32_t), self->atom_Bool,
+	       LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+
 	stateVector sv;
 
 	sv.child_type = self->atom_Float;
@@ -845,6 +1705,16 @@ restore (LV2_Handle                  instance,
 		irs.gain = *((float*)value);
 	}
 
+	value = retrieve (handle, self->zc_trim, &size, &type, &valflags);
+	if (value && size == sizeof (float) && type == self->atom_Float) {
+		irs.trim_threshold = *((float*)value);
+	}
+
+	value = retrieve (handle, self->zc_mtx_outs, &size, &type, &valflags);
+	if (value && size == sizeof (int32_t) && type == self->atom_Int) {
+		irs.matrix_outputs = std::max (0, std::min (*((int32_t*)value), (int32_t)MAX_CHN));
+	}
+
 	value = retrieve (handle, self->zc_chn_delay, &size, &type, &valflags);
 	if (value && size == sizeof (LV2_Atom) + sizeof (irs.channel_delay) && type == self->atom_Vector) {
 		if (((LV2_Atom*)value)->type == self->atom_Int) {
@@ -857,6 +1727,11 @@ restore (LV2_Handle                  instance,
 		irs.sum_inputs = *((int32_t*)value) ? true : false;
 	}
 
+	value = retrieve (handle, self->zc_lowrate, &size, &type, &valflags);
+	if (value && size == sizeof (int32_t) && type == self->atom_Bool) {
+		irs.lowrate_tail = *((int32_t*)value) ? true : false;
+	}
+
 	value = retrieve (handle, self->zc_chn_gain, &size, &type, &valflags);
 	if (value && size == sizeof (LV2_Atom) + sizeof (irs.channel_gain) && type == self->atom_Vector) {
 		if (((LV2_Atom*)value)->type == self->atom_Float) {
@@ -864,6 +1739,78 @@ restore (LV2_Handle                  instance,
 		}
 	}
 
+	value = retrieve (handle, self->zc_xfade, &size, &type, &valflags);
+	if (value && size == sizeof (float) && type == self->atom_Float) {
+		set_crossfade (self, *((float*)value));
+	} else {
+		set_crossfade (self, XFADE_MS);
+	}
+
+	value = retrieve (handle, self->zc_bank, &size, &type, &valflags);
+	if (value && size == sizeof (int32_t) && type == self->atom_Int) {
+		int32_t slot = *((int32_t*)value);
+		if (slot >= 0 && slot <= N_BANK) {
+			self->slot_select = slot;
+		}
+	} else {
+		self->slot_select = 0;
+	}
+
+	std::string bank_ir[N_BANK + 1];
+	for (int i = 1; i <= N_BANK; ++i) {
+		value = retrieve (handle, self->zc_bank_ir[i - 1], &size, &type, &valflags);
+		if (!value) {
+			continue;
+		}
+
+		char* bpath = map_path->absolute_path (map_path->handle, (const char*)value);
+		lv2_log_trace (&self->logger, "ZConvolv State: bank %d ir=%s\n", i, bpath);
+		bank_ir[i] = bpath;
+
+#ifdef LV2_STATE__freePath
+		if (free_path) {
+			free_path->free_path (free_path->handle, bpath);
+		} else
+#endif
+		{
+#ifndef _WIN32 // https://github.com/drobilla/lilv/issues/14
+			free (bpath);
+#endif
+		}
+	}
+
+	/* The worker loads all slots with a single CMD_BANKS, and keeps
+	 * slots that already hold the IR, see load_bank_worker(). Nothing
+	 * is scheduled if neither the state nor the plugin has a bank.
+	 * The engines in clv_slot[] can be replaced and deleted meanwhile,
+	 * and are not accessed here. */
+	bool sync = false;
+	pthread_mutex_lock (&self->queue_lock);
+	self->bank_irs = irs;
+	for (int i = 1; i <= N_BANK; ++i) {
+		self->bank_ir[i].swap (bank_ir[i]);
+		if (!self->bank_ir[i].empty () || self->bank_clv[i]) {
+			sync = true;
+		}
+	}
+	if (sync && !self->bank_sync) {
+		self->bank_sync = true;
+	} else {
+		/* a pending CMD_BANKS will use the new files */
+		sync = false;
+	}
+	pthread_mutex_unlock (&self->queue_lock);
+
+	if (sync) {
+		uint32_t d = CMD_BANKS;
+		if (LV2_WORKER_SUCCESS != schedule->schedule_work (schedule->handle, sizeof (uint32_t), &d)) {
+			lv2_log_warning (&self->logger, "ZConvolv State: cannot load bank\n");
+			pthread_mutex_lock (&self->queue_lock);
+			self->bank_sync = false;
+			pthread_mutex_unlock (&self->queue_lock);
+		}
+	}
+
 	value = retrieve (handle, self->zc_ir, &size, &type, &valflags);
 	if (!value) {
 		return LV2_STATE_ERR_NO_PROPERTY;
@@ -874,11 +1821,23 @@ restore (LV2_Handle                  instance,
 
 	LV2_State_Status rv = LV2_STATE_SUCCESS;
 	bool             ok = false;
+	GainCmd          gc;
 
 	if (pthread_mutex_trylock (&self->state_lock)) {
 		/* The worker is busy, just queue file. This will be processed
 		 * when the worker triggers a work response. */
 		set_queue (self, path, irs);
+	} else if (!self->clv_offline && self->clv_slot[0] && self->clv_slot[0]->path () == path && self->clv_slot[0]->prepare_ir_settings (irs, gc.upd)) {
+		/* only gain or delay changed, no need to load the file again.
+		 * With the lock held and no offline instance, the engine
+		 * cannot be swapped before the change was scheduled, it is
+		 * handed to run() via the worker's response. */
+		gc.cmd  = CMD_GAIN;
+		gc.slot = 0;
+		gc.clv  = self->clv_slot[0];
+		schedule->schedule_work (schedule->handle, sizeof (GainCmd), &gc);
+		pthread_mutex_unlock (&self->state_lock);
+		lv2_log_trace (&self->logger, "ZConvolv State: applying settings to the running engine\n");
 	} else if (thread_safe) {
 		pthread_mutex_unlock (&self->state_lock);
 		size_t const irssize = sizeof (ZeroConvoLV2::Convolver::IRSettings);
@@ -957,8 +1916,10 @@ opts_set (LV2_Handle instance, const LV2_Options_Option* options)
 			return LV2_OPTIONS_ERR_BAD_VALUE;
 		}
 		self->block_size = *((int32_t*)options[i].value);
-		if (self->clv_online) {
-			self->clv_online->reconfigure (self->block_size);
+		for (int s = 0; s <= N_BANK; ++s) {
+			if (self->clv_slot[s]) {
+				self->clv_slot[s]->reconfigure (self->block_size);
+			}
 		}
 		break;
 	}
@@ -1002,22 +1963,36 @@ inform_ui (zeroConvolv* self, bool mark_dirty)
 	if (!self->control || !self->notify || self->in_restore) {
 		return;
 	}
-	if (!self->clv_online || self->clv_online->path ().empty ()) {
+	if (!self->clv_slot[0] || self->clv_slot[0]->path ().empty ()) {
 		return;
 	}
 	if (!self->next_queued_file.empty ()) {
 		return;
 	}
 
-	const char* path = self->clv_online->path ().c_str ();
-
 	LV2_Atom_Forge_Frame frame;
+
+	for (int i = 0; i <= N_BANK; ++i) {
+		if (!self->clv_slot[i]) {
+			continue;
+		}
+		const char* path = self->clv_slot[i]->path ().c_str ();
+
+		lv2_atom_forge_frame_time (&self->forge, 0);
+		x_forge_object (&self->forge, &frame, 1, self->patch_Set);
+		lv2_atom_forge_property_head (&self->forge, self->patch_property, 0);
+		lv2_atom_forge_urid (&self->forge, i == 0 ? self->zc_ir : self->zc_bank_ir[i - 1]);
+		lv2_atom_forge_property_head (&self->forge, self->patch_value, 0);
+		lv2_atom_forge_path (&self->forge, path, strlen (path));
+		lv2_atom_forge_pop (&self->forge, &frame);
+	}
+
 	lv2_atom_forge_frame_time (&self->forge, 0);
 	x_forge_object (&self->forge, &frame, 1, self->patch_Set);
 	lv2_atom_forge_property_head (&self->forge, self->patch_property, 0);
-	lv2_atom_forge_urid (&self->forge, self->zc_ir);
+	lv2_atom_forge_urid (&self->forge, self->zc_bank);
 	lv2_atom_forge_property_head (&self->forge, self->patch_value, 0);
-	lv2_atom_forge_path (&self->forge, path, strlen (path));
+	lv2_atom_forge_int (&self->forge, self->slot_select);
 	lv2_atom_forge_pop (&self->forge, &frame);
 
 	if (mark_dirty) {
@@ -1028,10 +2003,10 @@ inform_ui (zeroConvolv* self, bool mark_dirty)
 }
 
 static const LV2_Atom*
-parse_patch_msg (zeroConvolv* self, const LV2_Atom_Object* obj)
+parse_patch_msg (zeroConvolv* self, const LV2_Atom_Object* obj, LV2_URID& key)
 {
-	const LV2_Atom* property  = NULL;
-	const LV2_Atom* file_path = NULL;
+	const LV2_Atom* property = NULL;
+	const LV2_Atom* value    = NULL;
 
 	if (obj->body.otype != self->patch_Set) {
 		return NULL;
@@ -1040,16 +2015,27 @@ parse_patch_msg (zeroConvolv* self, const LV2_Atom_Object* obj)
 	lv2_atom_object_get (obj, self->patch_property, &property, 0);
 	if (!property || property->type != self->atom_URID) {
 		return NULL;
-	} else if (((const LV2_Atom_URID*)property)->body != self->zc_ir) {
-		return NULL;
 	}
 
-	lv2_atom_object_get (obj, self->patch_value, &file_path, 0);
-	if (!file_path || file_path->type != self->atom_Path) {
+	lv2_atom_object_get (obj, self->patch_value, &value, 0);
+	if (!value) {
 		return NULL;
 	}
 
-	return file_path;
+	key = ((const LV2_Atom_URID*)property)->body;
+	return value;
+}
+
+/* bank slot of the given property, 0 if none */
+static uint32_t
+bank_slot (zeroConvolv* self, LV2_URID key)
+{
+	for (int i = 0; i < N_BANK; ++i) {
+		if (key == self->zc_bank_ir[i]) {
+			return i + 1;
+		}
+	}
+	return 0;
 }
 
 static void
@@ -1099,11 +2085,33 @@ run_cfg (LV2_Handle instance, uint32_t n_samples)
 		if (obj->body.otype == self->patch_Get) {
 			inform_ui (self, false);
 		} else if (obj->body.otype == self->patch_Set) {
-			const LV2_Atom* file_path = parse_patch_msg (self, obj);
-			if (!file_path || file_path->size < 1 || file_path->size > 1024) {
+			LV2_URID        key   = 0;
+			const LV2_Atom* value = parse_patch_msg (self, obj, key);
+			if (!value) {
+				continue;
+			}
+			if (key == self->zc_bank && value->type == self->atom_Int) {
+				const int32_t slot = ((const LV2_Atom_Int*)value)->body;
+				if (slot >= 0 && slot <= N_BANK) {
+					self->slot_select = slot;
+				}
+				continue;
+			}
+			if (key == self->zc_xfade && value->type == self->atom_Float) {
+				set_crossfade (self, ((const LV2_Atom_Float*)value)->body);
 				continue;
 			}
-			self->schedule->schedule_work (self->schedule->handle, lv2_atom_total_size (file_path), file_path);
+			if (value->type != self->atom_Path || value->size < 1 || value->size > 1024) {
+				continue;
+			}
+			if (key == self->zc_ir) {
+				/* a new IR replaces the bank selection */
+				self->slot_select = 0;
+				self->schedule->schedule_work (self->schedule->handle, lv2_atom_total_size (value), value);
+			} else if (bank_slot (self, key) > 0) {
+				const char* path = (const char*)(value + 1);
+				schedule_bank_load (self, self->schedule, bank_slot (self, key), path, strnlen (path, value->size));
+			}
 		}
 	}
 
@@ -1129,7 +2137,14 @@ run_cfg (LV2_Handle instance, uint32_t n_samples)
 		}
 	}
 
+	select_slot (self);
+
 	if (self->clv_online) {
+		self->clv_online->set_enabled (enabled);
+		if (self->clv_online->needs_flush () && !self->flush_pending) {
+			FlushCmd fc = { CMD_FLUSH, self->clv_online };
+			self->flush_pending = LV2_WORKER_SUCCESS == self->schedule->schedule_work (self->schedule->handle, sizeof (FlushCmd), &fc);
+		}
 		run (instance, n_samples);
 		return;
 	}
@@ -1256,6 +2271,16 @@ static const LV2_Descriptor descriptor5 = {
     cleanup,
     extension_data};
 
+static const LV2_Descriptor descriptor6 = {
+    ZC_PREFIX "Matrix",
+    instantiate,
+    connect_port,
+    activate,
+    run,
+    NULL, // deactivate,
+    cleanup,
+    extension_data};
+
 /* clang-format off */
 #undef LV2_SYMBOL_EXPORT
 #ifdef _WIN32
@@ -1281,6 +2306,8 @@ lv2_descriptor (uint32_t index)
 			return &descriptor4;
 		case 5:
 			return &descriptor5;
+		case 6:
+			return &descriptor6;
 		default:
 			return NULL;
 	}
@@ -37,14 +37,56 @@
 // * Remove unused interfaces which are not required for the plugin version,
 //   notably the API to link and update IRs, but also static globals were
 //   dropped.
+// * Optionally (WITH_LEVEL_STATS) record the worst-case cycle completion
+//   time of each level, used by tools/zconvo-tune.
+// * Allow partitions up to 128k and 16 levels for very long IRs.
+//   The partitioning heuristic accounts for the N log(N) FFT cost of
+//   partitions larger than 8k, see fftcost_scale().
+// * Skip the FFT of silent input blocks and MAC terms of silent input
+//   partitions. Once all input partitions are silent a level only
+//   clears its output. The threshold is set via set_silence_threshold().
+// * Add `flush` to clear all buffers of a running, but idle, Convproc
+//   without restarting the level threads.
+// * Do not start threads for levels without impulse response data
+//   (e.g. leading silence of a trimmed IR).
+// * Optionally limit the MAC of each partition to the bins that hold
+//   all but a given fraction of the IR energy (set_sparse_threshold).
+//   Late reverb partitions are usually band-limited.
+// * The first MAC term and the first level to contribute to an output
+//   store instead of accumulating.
+// * For `readtail` the level without latency adds the MAC terms of the
+//   previous input partitions once per partition, see process (true).
+// * Allocate nodes and spectra from a chunked arena per Convproc, and
+//   compile the node lists into flat arrays when processing starts.
+// * FFT workspace and I/O buffers are allocated from the arena as well,
+//   which is pre-sized and pre-faulted. Optionally (OPT_MEMLOCK) it is
+//   locked in memory while processing, and uses transparent huge pages
+//   (OPT_HUGEPAGE).
+// * Restored impdata_link(), with an optional gain. Linked paths share
+//   the spectra, and use the sparse bin count of the original.
+// * Added set_sync(), to process the cycles of the level threads in
+//   the calling thread instead, e.g. while freewheeling.
+// * Optionally (OPT_NO_THREADS) do not start level threads at all,
+//   for a deterministic output, e.g. for regression tests.
+// * readout() always waits for the previous cycle of a level. It is
+//   reported as late (FL_LATE) if the wait took longer than the period
+//   given to start_process().
 //
 // ----------------------------------------------------------------------------
 
+#include <math.h>
+#include <new>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include <time.h>
+
 #ifdef __APPLE__
 #include <mach/mach_time.h>
 #include <mach/thread_act.h>
@@ -58,28 +100,186 @@ float Convproc::_fft_cost = 5.0f;
 
 static pthread_mutex_t fftw_planner_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static float*
-calloc_real (uint32_t k)
+static double
+time_now (void)
 {
-	float* p = fftwf_alloc_real (k);
-	if (!p) {
-		throw (Converror (Converror::MEM_ALLOC));
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* MAC of a partition: bins [0, nset) of freq are added
+ * to, bins [nset, nbin) are stored. */
+static inline void
+mac_full (fftwf_complex* freq, fftwf_complex const* ffta, fftwf_complex const* fftb, uint32_t nset, uint32_t nbin)
+{
+	uint32_t k;
+
+	for (k = 0; k < nbin && k < nset; k++) {
+		freq[k][0] += ffta[k][0] * fftb[k][0] - ffta[k][1] * fftb[k][1];
+		freq[k][1] += ffta[k][0] * fftb[k][1] + ffta[k][1] * fftb[k][0];
+	}
+	for (; k < nbin; k++) {
+		freq[k][0] = ffta[k][0] * fftb[k][0] - ffta[k][1] * fftb[k][1];
+		freq[k][1] = ffta[k][0] * fftb[k][1] + ffta[k][1] * fftb[k][0];
+	}
+}
+
+/* As mac_full(), with the IR scaled by gain */
+static inline void
+mac_gain (fftwf_complex* freq, fftwf_complex const* ffta, fftwf_complex const* fftb, float gain, uint32_t nset, uint32_t nbin)
+{
+	uint32_t k;
+	float    br, bi;
+
+	for (k = 0; k < nbin && k < nset; k++) {
+		br = gain * fftb[k][0];
+		bi = gain * fftb[k][1];
+		freq[k][0] += ffta[k][0] * br - ffta[k][1] * bi;
+		freq[k][1] += ffta[k][0] * bi + ffta[k][1] * br;
+	}
+	for (; k < nbin; k++) {
+		br = gain * fftb[k][0];
+		bi = gain * fftb[k][1];
+		freq[k][0] = ffta[k][0] * br - ffta[k][1] * bi;
+		freq[k][1] = ffta[k][0] * bi + ffta[k][1] * br;
 	}
-	memset (p, 0, k * sizeof (float));
-	return p;
 }
 
-static fftwf_complex*
-calloc_complex (uint32_t k)
+Convarena::Convarena (void)
+	: _list (0)
+	, _bytes (0)
+	, _locked (0)
+	, _count (0)
+	, _nchunk (0)
+	, _huge (false)
 {
-	fftwf_complex* p = fftwf_alloc_complex (k);
-	if (!p) {
+}
+
+Convarena::~Convarena (void)
+{
+	clear ();
+}
+
+Convarena::Chunk*
+Convarena::newchunk (size_t size)
+{
+	Chunk* C = new (std::nothrow) Chunk;
+	if (!C) {
+		throw (Converror (Converror::MEM_ALLOC));
+	}
+#ifdef _WIN32
+	C->_len = size + ALIGN;
+	C->_mem = (char*)fftwf_malloc (C->_len);
+#else
+	const size_t page = sysconf (_SC_PAGESIZE);
+	C->_len           = (size + ALIGN + page - 1) & ~(page - 1);
+	void* p           = mmap (NULL, C->_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	C->_mem           = (p == MAP_FAILED) ? 0 : (char*)p;
+#endif
+	if (!C->_mem) {
+		delete C;
 		throw (Converror (Converror::MEM_ALLOC));
 	}
-	memset (p, 0, k * sizeof (fftwf_complex));
+#ifdef MADV_HUGEPAGE
+	if (_huge) {
+		madvise (C->_mem, C->_len, MADV_HUGEPAGE);
+	}
+#endif
+	/* zero, and pre-fault all pages */
+	memset (C->_mem, 0, C->_len);
+	C->_base = C->_mem + ((ALIGN - ((uintptr_t)C->_mem & (ALIGN - 1))) & (ALIGN - 1));
+	C->_size = C->_len - (C->_base - C->_mem);
+	C->_used = 0;
+	C->_lock = false;
+	C->_next = 0;
+	_bytes += C->_len;
+	++_nchunk;
+	return C;
+}
+
+void
+Convarena::reserve (size_t size)
+{
+	Chunk* C = newchunk (size);
+	C->_next = _list;
+	_list    = C;
+}
+
+void*
+Convarena::alloc (size_t size)
+{
+	Chunk*       C;
+	const size_t chunk = _huge ? CHUNK_HUGE : CHUNK;
+
+	size = round (size);
+	if (!_list || _list->_used + size > _list->_size) {
+		C = newchunk (size > chunk / 4 ? size : chunk);
+		if (_list && size > chunk / 4) {
+			/* a large allocation gets its own chunk, the current
+			 * one remains in use for subsequent small ones */
+			C->_next     = _list->_next;
+			_list->_next = C;
+		} else {
+			C->_next = _list;
+			_list    = C;
+		}
+	} else {
+		C = _list;
+	}
+	/* chunks are zeroed when created, and memory is never reused */
+	char* p = C->_base + C->_used;
+	C->_used += size;
+	++_count;
 	return p;
 }
 
+void
+Convarena::lock (void)
+{
+#ifndef _WIN32
+	for (Chunk* C = _list; C; C = C->_next) {
+		if (!C->_lock && mlock (C->_mem, C->_len) == 0) {
+			C->_lock = true;
+			_locked += C->_len;
+		}
+	}
+#endif
+}
+
+void
+Convarena::unlock (void)
+{
+#ifndef _WIN32
+	for (Chunk* C = _list; C; C = C->_next) {
+		if (C->_lock) {
+			munlock (C->_mem, C->_len);
+			C->_lock = false;
+		}
+	}
+#endif
+	_locked = 0;
+}
+
+void
+Convarena::clear (void)
+{
+	while (_list) {
+		Chunk* C = _list;
+		_list    = C->_next;
+#ifdef _WIN32
+		fftwf_free (C->_mem);
+#else
+		munmap (C->_mem, C->_len);
+#endif
+		delete C;
+	}
+	_bytes  = 0;
+	_locked = 0;
+	_count  = 0;
+	_nchunk = 0;
+}
+
 Convproc::Convproc (void)
 	: _state (ST_IDLE)
 	, _options (0)
@@ -89,7 +289,11 @@ Convproc::Convproc (void)
 	, _minpart (0)
 	, _maxpart (0)
 	, _nlevels (0)
+	, _prepared (false)
 	, _latecnt (0)
+	, _silence (0)
+	, _sparse (0)
+	, _sync (false)
 {
 	memset (_inpbuff, 0, sizeof (_inpbuff)); // MAXINP
 	memset (_outbuff, 0, sizeof (_outbuff)); // MAXOUT
@@ -108,6 +312,54 @@ Convproc::set_options (uint32_t options)
 	_options = options;
 }
 
+void
+Convproc::set_silence_threshold (float power)
+{
+	uint32_t k;
+
+	_silence = power > 0 ? power : 0;
+	for (k = 0; k < _nlevels; k++) {
+		_convlev[k]->_silence = _silence;
+	}
+}
+
+void
+Convproc::set_sync (bool sync)
+{
+	uint32_t k;
+
+	_sync = sync;
+	for (k = 0; k < _nlevels; k++) {
+		_convlev[k]->_sync = _sync;
+	}
+}
+
+void
+Convproc::set_sparse_threshold (float err)
+{
+	_sparse = err > 0 ? err : 0;
+}
+
+/* The cost model assumes a constant FFT cost per sample, which
+ * holds well enough up to 8k partitions (FFTCOST_KNEE). Beyond that
+ * the log(N) term of an FFT of length 2 * size dominates, the cost per
+ * sample is scaled by log2 (2 * size) / log2 (2 * FFTCOST_KNEE), which
+ * is 1 at the knee. The MAC of large partitions slows down as well,
+ * since its data no longer fits the cache, hence this is less than a
+ * plain log2 (N) scaling. `zconvo-tune --maxpart` prints the measured
+ * FFT/MAC cost ratio relative to the knee next to this model; on x86_64
+ * it was 1.13 - 1.56 for 16k - 128k, where this gives 1.07 - 1.29, so
+ * the model errs on the side of larger partitions by at most one step.
+ */
+float
+Convproc::fftcost_scale (uint32_t size)
+{
+	if (size <= FFTCOST_KNEE) {
+		return 1.f;
+	}
+	return log2f (2.f * size) / log2f (2.f * FFTCOST_KNEE);
+}
+
 int
 Convproc::configure (uint32_t ninp,
                      uint32_t nout,
@@ -118,8 +370,11 @@ Convproc::configure (uint32_t ninp,
                      float    density)
 {
 	uint32_t offs, npar, size, pind, nmin, i;
+	uint32_t loffs[MAXLEV], lnpar[MAXLEV], lsize[MAXLEV];
 	int      prio, step, d, r, s;
+	int      lprio[MAXLEV];
 	float    cfft, cmac;
+	size_t   bytes;
 
 	if (_state != ST_IDLE) {
 		return Converror::BAD_STATE;
@@ -151,7 +406,7 @@ Convproc::configure (uint32_t ninp,
 	step = (cfft < 4 * cmac) ? 1 : 2;
 	if (step == 2) {
 		r = maxpart / minpart;
-		s = (r & 0xAAAA) ? 1 : 2;
+		s = (r & 0xAAAAAAAA) ? 1 : 2;
 	} else {
 		s = 1;
 	}
@@ -166,42 +421,61 @@ Convproc::configure (uint32_t ninp,
 		size <<= 1;
 	}
 
-	try {
-		for (offs = pind = 0; offs < maxsize; pind++) {
-			npar = (maxsize - offs + size - 1) / size;
-			if ((size < maxpart) && (npar > nmin)) {
-				r = 1 << s;
-				d = npar - nmin;
-				d = d - (d + r - 1) / r;
-				if (cfft < d * cmac) {
-					npar = nmin;
-				}
-			}
-			_convlev[pind] = new Convlevel ();
-			_convlev[pind]->configure (prio, offs, npar, size, _options);
-			offs += size * npar;
-			if (offs < maxsize) {
-				prio -= s;
-				size <<= s;
-				s    = step;
-				nmin = (s == 1) ? 2 : 6;
+	for (offs = pind = 0; offs < maxsize; pind++) {
+		npar = (maxsize - offs + size - 1) / size;
+		if ((size < maxpart) && (npar > nmin)) {
+			r = 1 << s;
+			d = npar - nmin;
+			d = d - (d + r - 1) / r;
+			if (cfft * fftcost_scale (size << s) < d * cmac) {
+				npar = nmin;
 			}
 		}
+		lprio[pind] = prio;
+		loffs[pind] = offs;
+		lnpar[pind] = npar;
+		lsize[pind] = size;
+		offs += size * npar;
+		if (offs < maxsize) {
+			prio -= s;
+			size <<= s;
+			s    = step;
+			nmin = (s == 1) ? 2 : 6;
+		}
+	}
+
+	_ninp    = ninp;
+	_nout    = nout;
+	_quantum = quantum;
+	_minpart = minpart;
+	_maxpart = size;
+	_latecnt = 0;
+	_inpsize = 2 * size;
 
-		_ninp    = ninp;
-		_nout    = nout;
-		_quantum = quantum;
-		_minpart = minpart;
-		_maxpart = size;
-		_nlevels = pind;
-		_latecnt = 0;
-		_inpsize = 2 * size;
+	try {
+		/* Pre-size the arena for the buffers that follow from the
+		 * partition layout. The IR spectra and the routing graph are
+		 * added later, in chunks that are pre-faulted as well. */
+		_arena._huge = (_options & OPT_HUGEPAGE) != 0;
+		bytes        = nout * Convarena::round (_minpart * sizeof (float));
+		bytes += ninp * Convarena::round (_inpsize * sizeof (float));
+		for (i = 0; i < pind; i++) {
+			bytes += Convlevel::workspace (lsize[i], lnpar[i], ninp, nout, _options);
+		}
+		_arena.reserve (bytes);
 
 		for (i = 0; i < ninp; i++) {
-			_inpbuff[i] = new float[_inpsize];
+			_inpbuff[i] = (float*)_arena.alloc (_inpsize * sizeof (float));
 		}
 		for (i = 0; i < nout; i++) {
-			_outbuff[i] = new float[_minpart];
+			_outbuff[i] = (float*)_arena.alloc (_minpart * sizeof (float));
+		}
+		for (i = 0; i < pind; i++) {
+			_convlev[i] = new Convlevel ();
+			_nlevels    = i + 1;
+			_convlev[i]->configure (lprio[i], loffs[i], lnpar[i], lsize[i], _options, &_arena);
+			_convlev[i]->_silence = _silence;
+			_convlev[i]->_sync    = _sync;
 		}
 	} catch (...) {
 		cleanup ();
@@ -254,6 +528,39 @@ Convproc::impdata_clear (uint32_t inp, uint32_t out)
 	return 0;
 }
 
+int
+Convproc::impdata_link (uint32_t inp1,
+                        uint32_t out1,
+                        uint32_t inp2,
+                        uint32_t out2,
+                        float    gain)
+{
+	uint32_t j;
+
+	if ((inp1 >= _ninp) || (out1 >= _nout)) {
+		return Converror::BAD_PARAM;
+	}
+	if ((inp2 >= _ninp) || (out2 >= _nout)) {
+		return Converror::BAD_PARAM;
+	}
+	if ((inp1 == inp2) && (out1 == out2)) {
+		return Converror::BAD_PARAM;
+	}
+	if (_state != ST_STOP) {
+		return Converror::BAD_STATE;
+	}
+
+	try {
+		for (j = 0; j < _nlevels; j++) {
+			_convlev[j]->impdata_link (inp1, out1, inp2, out2, gain);
+		}
+	} catch (...) {
+		cleanup ();
+		return Converror::MEM_ALLOC;
+	}
+	return 0;
+}
+
 int
 Convproc::reset (void)
 {
@@ -274,15 +581,86 @@ Convproc::reset (void)
 	return 0;
 }
 
+int
+Convproc::flush (void)
+{
+	uint32_t k;
+
+	if (_state != ST_PROC) {
+		return Converror::BAD_STATE;
+	}
+	for (k = 0; k < _nlevels; k++) {
+		_convlev[k]->flush ();
+	}
+	for (k = 0; k < _ninp; k++) {
+		memset (_inpbuff[k], 0, _inpsize * sizeof (float));
+	}
+	for (k = 0; k < _nout; k++) {
+		memset (_outbuff[k], 0, _minpart * sizeof (float));
+	}
+	_latecnt = 0;
+	_inpoffs = 0;
+	_outoffs = 0;
+	return 0;
+}
+
 int
 Convproc::start_process (int abspri, int policy, double period_ns)
 {
+	int rv;
+
 	if (_state != ST_STOP) {
 		return Converror::BAD_STATE;
 	}
+	if (!_prepared && (rv = prepare_process ())) {
+		return rv;
+	}
 	return restart_process (abspri, policy, period_ns);
 }
 
+int
+Convproc::prepare_process (void)
+{
+	if (_state != ST_STOP || _prepared) {
+		return Converror::BAD_STATE;
+	}
+	sparsify ();
+	try {
+		for (uint32_t k = 0; k < _nlevels; k++) {
+			_convlev[k]->compile ();
+		}
+	} catch (...) {
+		return Converror::MEM_ALLOC;
+	}
+	_prepared = true;
+	return 0;
+}
+
+/* Distribute the permitted error evenly over all partitions
+ * of each input/output pair. */
+void
+Convproc::sparsify (void)
+{
+	uint32_t inp, out, k, npar;
+	double   etot;
+
+	for (inp = 0; inp < _ninp; inp++) {
+		for (out = 0; out < _nout; out++) {
+			etot = 0;
+			npar = 0;
+			for (k = 0; k < _nlevels; k++) {
+				_convlev[k]->impdata_energy (inp, out, etot, npar);
+			}
+			if (npar == 0) {
+				continue;
+			}
+			for (k = 0; k < _nlevels; k++) {
+				_convlev[k]->impdata_sparsify (inp, out, _sparse * etot / npar);
+			}
+		}
+	}
+}
+
 int
 Convproc::restart_process (int abspri, int policy, double period_ns)
 {
@@ -308,7 +686,17 @@ Convproc::restart_process (int abspri, int policy, double period_ns)
 	_outoffs = 0;
 	reset ();
 
+	if (_options & OPT_MEMLOCK) {
+		/* failure is not fatal, the memory was pre-faulted.
+		 * The caller can compare memory_stats () */
+		_arena.lock ();
+	}
+
 	for (k = (_minpart == _quantum) ? 1 : 0; k < _nlevels; k++) {
+		if (_convlev[k]->empty ()) {
+			/* nothing to do, process() is called inline */
+			continue;
+		}
 		if (!_convlev[k]->start (abspri, policy, period_ns)) {
 			stop_process (true);
 			cleanup ();
@@ -342,12 +730,16 @@ Convproc::process ()
 
 	_outoffs += _quantum;
 	if (_outoffs == _minpart) {
+		/* the first level to output to a buffer overwrites it */
+		uint64_t outset = 0;
 		_outoffs = 0;
-		for (k = 0; k < _nout; k++) {
-			memset (_outbuff[k], 0, _minpart * sizeof (float));
-		}
 		for (k = 0; k < _nlevels; k++) {
-			f |= _convlev[k]->readout ();
+			f |= _convlev[k]->readout (outset);
+		}
+		for (k = 0; k < _nout; k++) {
+			if (!(outset & (1ULL << k))) {
+				memset (_outbuff[k], 0, _minpart * sizeof (float));
+			}
 		}
 		if (f) {
 			if (++_latecnt >= 5) {
@@ -376,11 +768,14 @@ Convproc::tailonly (uint32_t n_samples)
 	uint32_t outoffs = _outoffs;
 	outoffs += _quantum;
 	if (outoffs == _minpart) {
-		for (k = 0; k < _nout; k++) {
-			memset (_outbuff[k], 0, n_samples * sizeof (float));
-		}
+		uint64_t outset = 0;
 		for (k = 0; k < _nlevels; k++) {
-			f |= _convlev[k]->readtail (n_samples);
+			f |= _convlev[k]->readtail (n_samples, outset);
+		}
+		for (k = 0; k < _nout; k++) {
+			if (!(outset & (1ULL << k))) {
+				memset (_outbuff[k], 0, n_samples * sizeof (float));
+			}
 		}
 	}
 	return f;
@@ -410,35 +805,32 @@ Convproc::cleanup (void)
 		usleep (40000);
 		sched_yield ();
 	}
-	for (k = 0; k < _ninp; k++) {
-		delete[] _inpbuff[k];
-		_inpbuff[k] = 0;
-	}
-	for (k = 0; k < _nout; k++) {
-		delete[] _outbuff[k];
-		_outbuff[k] = 0;
-	}
 	for (k = 0; k < _nlevels; k++) {
 		delete _convlev[k];
 		_convlev[k] = 0;
 	}
-
-	_state   = ST_IDLE;
-	_options = 0;
-	_ninp    = 0;
-	_nout    = 0;
-	_quantum = 0;
-	_minpart = 0;
-	_maxpart = 0;
-	_nlevels = 0;
-	_latecnt = 0;
+	/* the arena owns the I/O buffers */
+	_arena.clear ();
+	memset (_inpbuff, 0, sizeof (_inpbuff));
+	memset (_outbuff, 0, sizeof (_outbuff));
+
+	_state    = ST_IDLE;
+	_options  = 0;
+	_ninp     = 0;
+	_nout     = 0;
+	_quantum  = 0;
+	_minpart  = 0;
+	_maxpart  = 0;
+	_nlevels  = 0;
+	_latecnt  = 0;
+	_prepared = false;
 	return 0;
 }
 
 bool
 Convproc::check_started (uint32_t k)
 {
-	for (; (k < _nlevels) && (_convlev[k]->_stat == Convlevel::ST_PROC); k++) ;
+	for (; (k < _nlevels) && (_convlev[k]->_stat == Convlevel::ST_PROC || _convlev[k]->_stat == Convlevel::ST_SYNC || _convlev[k]->empty ()); k++) ;
 	return (k == _nlevels || _nlevels == 0) ? true : false;
 }
 
@@ -463,7 +855,65 @@ Convproc::print (FILE* F)
 	for (k = 0; k < _nlevels; k++) {
 		_convlev[k]->print (F);
 	}
+	fprintf (F, "arena: %u allocations, %lu bytes in %u chunks, %lu locked\n",
+	         _arena._count, (unsigned long)_arena._bytes, _arena._nchunk,
+	         (unsigned long)_arena._locked);
+}
+
+void
+Convproc::memory_stats (size_t& bytes, size_t& locked, uint32_t& count) const
+{
+	bytes  = _arena._bytes;
+	locked = _arena._locked;
+	count  = _arena._count;
+}
+
+void
+Convproc::unlock_memory (void)
+{
+	if (_state != ST_PROC) {
+		_arena.unlock ();
+	}
+}
+
+void
+Convproc::skip_stats (SkipStats& s) const
+{
+	for (uint32_t k = 0; k < _nlevels; k++) {
+		Convlevel const* L = _convlev[k];
+		s.nfft += L->_nfft;
+		s.sfft += L->_sfft;
+		s.nmac += L->_nmac;
+		s.smac += L->_smac;
+		s.nbins += L->_nbins;
+		s.sbins += L->_sbins;
+	}
+}
+
+#ifdef WITH_LEVEL_STATS
+void
+Convproc::level_stats (uint32_t lev, uint32_t& parsize, uint32_t& npar, double& t_max) const
+{
+	if (lev >= _nlevels) {
+		parsize = npar = 0;
+		t_max   = 0;
+		return;
+	}
+	parsize = _convlev[lev]->_parsize;
+	npar    = _convlev[lev]->_npar;
+	t_max   = _convlev[lev]->_t_max;
+}
+
+void
+Convproc::reset_stats (void)
+{
+	uint32_t k;
+
+	for (k = 0; k < _nlevels; k++) {
+		_convlev[k]->reset_stats ();
+	}
 }
+#endif
 
 Convlevel::Convlevel (void)
 	: _stat (ST_IDLE)
@@ -475,11 +925,22 @@ Convlevel::Convlevel (void)
 #endif
 	, _inp_list (0)
 	, _out_list (0)
+	, _arena (0)
+	, _inps (0)
+	, _outs (0)
+	, _macs (0)
+	, _omac (0)
+	, _ninps (0)
+	, _nouts (0)
 	, _plan_r2c (0)
 	, _plan_c2r (0)
 	, _time_data (0)
 	, _prep_data (0)
 	, _freq_data (0)
+	, _silence (0)
+	, _sync (false)
+	, _partial (false)
+	, _t_late (0)
 {
 }
 
@@ -489,11 +950,12 @@ Convlevel::~Convlevel (void)
 }
 
 void
-Convlevel::configure (int      prio,
-                      uint32_t offs,
-                      uint32_t npar,
-                      uint32_t parsize,
-                      uint32_t options)
+Convlevel::configure (int        prio,
+                      uint32_t   offs,
+                      uint32_t   npar,
+                      uint32_t   parsize,
+                      uint32_t   options,
+                      Convarena* arena)
 {
 	int fftwopt = (options & OPT_FFTW_MEASURE) ? FFTW_MEASURE : FFTW_ESTIMATE;
 
@@ -502,18 +964,32 @@ Convlevel::configure (int      prio,
 	_npar    = npar;
 	_parsize = parsize;
 	_options = options;
+	_arena   = arena;
 
-	_time_data = calloc_real (2 * _parsize);
-	_prep_data = calloc_real (2 * _parsize);
-	_freq_data = calloc_complex (_parsize + 1);
+	_time_data = (float*)arena->alloc (2 * _parsize * sizeof (float));
+	_prep_data = (float*)arena->alloc (2 * _parsize * sizeof (float));
+	_freq_data = (fftwf_complex*)arena->alloc ((_parsize + 1) * sizeof (fftwf_complex));
 	pthread_mutex_lock (&fftw_planner_lock);
 	_plan_r2c = fftwf_plan_dft_r2c_1d (2 * _parsize, _time_data, _freq_data, fftwopt);
 	_plan_c2r = fftwf_plan_dft_c2r_1d (2 * _parsize, _freq_data, _time_data, fftwopt);
 	pthread_mutex_unlock (&fftw_planner_lock);
-	if (_plan_r2c && _plan_c2r) {
-		return;
+	if (!_plan_r2c || !_plan_c2r) {
+		throw (Converror (Converror::MEM_ALLOC));
 	}
-	throw (Converror (Converror::MEM_ALLOC));
+}
+
+/* Arena bytes used by configure(), and by the input
+ * and output nodes when all inputs and outputs are used. */
+size_t
+Convlevel::workspace (uint32_t parsize, uint32_t npar, uint32_t ninp, uint32_t nout, uint32_t options)
+{
+	const size_t spec = Convarena::round ((parsize + 1) * sizeof (fftwf_complex));
+	const size_t time = Convarena::round (2 * parsize * sizeof (float));
+
+	size_t n = 2 * time + spec;
+	n += ninp * (npar * spec + Convarena::round (npar * sizeof (fftwf_complex*)) + Convarena::round (npar * sizeof (bool)));
+	n += nout * 3 * Convarena::round (parsize * sizeof (float));
+	return n;
 }
 
 void
@@ -544,7 +1020,7 @@ Convlevel::impdata_write (uint32_t inp,
 			return;
 		}
 		if (M->_fftb == 0) {
-			M->alloc_fftb (_npar);
+			M->alloc_fftb (_npar, _arena);
 		}
 	} else {
 		M = findmacnode (inp, out, false);
@@ -559,7 +1035,8 @@ Convlevel::impdata_write (uint32_t inp,
 		if ((i0 < n) && (i1 > 0)) {
 			fftb = M->_fftb[k];
 			if (fftb == 0 && create) {
-				M->_fftb[k] = fftb = calloc_complex (_parsize + 1);
+				M->_fftb[k] = fftb = (fftwf_complex*)_arena->alloc ((_parsize + 1) * sizeof (fftwf_complex));
+				M->_nbin[k] = _parsize + 1;
 			}
 			if (fftb && data) {
 				memset (_prep_data, 0, 2 * _parsize * sizeof (float));
@@ -596,24 +1073,145 @@ Convlevel::impdata_clear (uint32_t inp, uint32_t out)
 	}
 }
 
+/* Links always refer to a node that has its own spectra */
+void
+Convlevel::impdata_link (uint32_t inp1,
+                         uint32_t out1,
+                         uint32_t inp2,
+                         uint32_t out2,
+                         float    gain)
+{
+	Macnode* M1;
+	Macnode* M2;
+
+	M1 = findmacnode (inp1, out1, false);
+	if (!M1) {
+		return;
+	}
+	if (M1->_link) {
+		gain *= M1->_gain;
+		M1 = M1->_link;
+	}
+	M2        = findmacnode (inp2, out2, true);
+	M2->_link = M1;
+	M2->_gain = gain;
+}
+
+/* Accumulate the energy of all partitions of the given
+ * input/output pair (in the time domain) and count them. */
+void
+Convlevel::impdata_energy (uint32_t inp, uint32_t out, double& etot, uint32_t& npar)
+{
+	uint32_t i;
+	Macnode* M;
+
+	M = findmacnode (inp, out, false);
+	if (M == 0 || M->_link || M->_fftb == 0) {
+		return;
+	}
+	for (i = 0; i < _npar; i++) {
+		if (M->_fftb[i]) {
+			etot += binenergy (M->_fftb[i], 0, _parsize + 1);
+			npar++;
+		}
+	}
+}
+
+/* Find the number of bins of each partition so that the energy
+ * of the omitted high frequency bins does not exceed emax. */
+void
+Convlevel::impdata_sparsify (uint32_t inp, uint32_t out, double emax)
+{
+	uint32_t       i, k;
+	double         e;
+	fftwf_complex* fftb;
+	Macnode*       M;
+
+	M = findmacnode (inp, out, false);
+	if (M == 0 || M->_link || M->_fftb == 0) {
+		return;
+	}
+	for (i = 0; i < _npar; i++) {
+		if (!(fftb = M->_fftb[i])) {
+			continue;
+		}
+		e = 0;
+		for (k = _parsize + 1; k > 0; k--) {
+			e += binenergy (fftb, k - 1, k);
+			if (e > emax) {
+				break;
+			}
+		}
+		M->_nbin[i] = k;
+	}
+}
+
+/* Energy of the bins [k0, k1) of a partition, scaled to match the
+ * time domain (Parseval, bins 1 .. parsize-1 are counted twice).
+ * The partition spectra are normalized by 1 / (2 * parsize). */
+double
+Convlevel::binenergy (fftwf_complex const* fftb, uint32_t k0, uint32_t k1) const
+{
+	uint32_t k;
+	double   e = 0;
+
+	for (k = k0; k < k1; k++) {
+		const double p = fftb[k][0] * fftb[k][0] + fftb[k][1] * fftb[k][1];
+		e += (k == 0 || k == _parsize) ? p : 2 * p;
+	}
+	return 2.0 * _parsize * e;
+}
+
 void
 Convlevel::reset (uint32_t inpsize,
                   uint32_t outsize,
                   float**  inpbuff,
                   float**  outbuff)
 {
-	uint32_t i;
-	Inpnode* X;
-	Outnode* Y;
-
 	_inpsize = inpsize;
 	_outsize = outsize;
 	_inpbuff = inpbuff;
 	_outbuff = outbuff;
+	clear ();
+	_bits = _parsize / _outsize;
+	_wait = 0;
+	_nfft = 0;
+	_nmac = 0;
+	_sfft = 0;
+	_smac = 0;
+	_nbins = 0;
+	_sbins = 0;
+	_trig.init (0, 0);
+	_done.init (0, 0);
+#ifdef WITH_LEVEL_STATS
+	_t_trig = 0;
+	_t_max  = 0;
+#endif
+}
+
+void
+Convlevel::flush (void)
+{
+	while (_wait) {
+		_done.wait ();
+		_wait--;
+	}
+	clear ();
+}
+
+void
+Convlevel::clear (void)
+{
+	uint32_t i;
+	Inpnode* X;
+	Outnode* Y;
+
 	for (X = _inp_list; X; X = X->_next) {
 		for (i = 0; i < _npar; i++) {
 			memset (X->_ffta[i], 0, (_parsize + 1) * sizeof (fftwf_complex));
+			X->_act[i] = false;
 		}
+		X->_nact = 0;
 	}
 	for (Y = _out_list; Y; Y = Y->_next) {
 		for (i = 0; i < 3; i++) {
@@ -627,14 +1225,19 @@ Convlevel::reset (uint32_t inpsize,
 		_outoffs = _parsize / 2;
 		_inpoffs = _inpsize - _outoffs;
 	}
-	_bits  = _parsize / _outsize;
-	_wait  = 0;
-	_ptind = 0;
-	_opind = 0;
-	_trig.init (0, 0);
-	_done.init (0, 0);
+	_ptind   = 0;
+	_opind   = 0;
+	_partial = false;
 }
 
+#ifdef WITH_LEVEL_STATS
+void
+Convlevel::reset_stats (void)
+{
+	_t_max = 0;
+}
+#endif
+
 bool
 Convlevel::start (int abspri, int policy, double period_ns)
 {
@@ -645,6 +1248,12 @@ Convlevel::start (int abspri, int policy, double period_ns)
 #ifndef PTW32_VERSION
 	_pthr = 0;
 #endif
+	_t_late = 1e-9 * period_ns;
+	if (_options & OPT_NO_THREADS) {
+		/* cycles are processed by readout () */
+		_stat = ST_SYNC;
+		return true;
+	}
 	min = sched_get_priority_min (policy);
 	max = sched_get_priority_max (policy);
 	abspri += _prio;
@@ -725,7 +1334,10 @@ Convlevel::start (int abspri, int policy, double period_ns)
 void
 Convlevel::stop (void)
 {
-	if (_stat != ST_IDLE) {
+	if (_stat == ST_SYNC) {
+		/* there is no thread */
+		_stat = ST_IDLE;
+	} else if (_stat != ST_IDLE) {
 		_stat = ST_TERM;
 		_trig.post ();
 	}
@@ -734,40 +1346,21 @@ Convlevel::stop (void)
 void
 Convlevel::cleanup (void)
 {
-	Inpnode *X, *X1;
-	Outnode *Y, *Y1;
-	Macnode *M, *M1;
-
-	X = _inp_list;
-	while (X) {
-		X1 = X->_next;
-		delete X;
-		X = X1;
-	}
+	/* nodes are released with the arena */
 	_inp_list = 0;
-
-	Y = _out_list;
-	while (Y) {
-		M = Y->_list;
-		while (M) {
-			M1 = M->_next;
-			delete M;
-			M = M1;
-		}
-		Y1 = Y->_next;
-		delete Y;
-		Y = Y1;
-	}
 	_out_list = 0;
+	_inps     = 0;
+	_outs     = 0;
+	_macs     = 0;
+	_omac     = 0;
+	_ninps    = 0;
+	_nouts    = 0;
 
 	pthread_mutex_lock (&fftw_planner_lock);
 	fftwf_destroy_plan (_plan_r2c);
 	fftwf_destroy_plan (_plan_c2r);
 	pthread_mutex_unlock (&fftw_planner_lock);
 
-	fftwf_free (_time_data);
-	fftwf_free (_prep_data);
-	fftwf_free (_freq_data);
 	_plan_r2c  = 0;
 	_plan_c2r  = 0;
 	_time_data = 0;
@@ -796,61 +1389,99 @@ Convlevel::main (void)
 			return;
 		}
 		process ();
+#ifdef WITH_LEVEL_STATS
+		const double dt = time_now () - _t_trig;
+		if (dt > _t_max) {
+			_t_max = dt;
+		}
+#endif
 		_done.post ();
 	}
 }
 
 void
-Convlevel::process ()
+Convlevel::process (bool partial)
 {
-	uint32_t       i, i1, j, k, n1, n2, opi1, opi2;
-	Inpnode const* X;
-	Macnode const* M;
+	uint32_t       i, i1, j, j0, j1, m, n1, n2, o, nact, nbin, nset, opi1, opi2;
+	Inpnode*       X;
+	Macterm const* T;
 	Outnode const* Y;
 	fftwf_complex* ffta;
 	fftwf_complex* fftb;
 	float*         inpd;
-	float*         outd;
-
-	i1       = _inpoffs;
-	n1       = _parsize;
-	n2       = 0;
-	_inpoffs = i1 + n1;
-	if (_inpoffs >= _inpsize) {
-		_inpoffs -= _inpsize;
-		n2 = _inpoffs;
-		n1 -= n2;
-	}
+	bool           act;
 
 	opi1 = (_opind + 1) % 3;
 	opi2 = (_opind + 2) % 3;
 
-	for (X = _inp_list; X; X = X->_next) {
-		inpd = _inpbuff[X->_inp];
-		if (n1) {
-			memcpy (_time_data, inpd + i1, n1 * sizeof (float));
+	/* MAC terms [j0, j1): the terms of previous partitions are
+	 * skipped when process (true) already added them */
+	j0   = partial ? 1 : 0;
+	j1   = _partial ? 1 : _npar;
+	nact = 0;
+
+	for (m = 0; m < _ninps && partial; m++) {
+		nact += _inps[m]->_nact;
+	}
+
+	if (!partial) {
+		i1       = _inpoffs;
+		n1       = _parsize;
+		n2       = 0;
+		_inpoffs = i1 + n1;
+		if (_inpoffs >= _inpsize) {
+			_inpoffs -= _inpsize;
+			n2 = _inpoffs;
+			n1 -= n2;
 		}
-		if (n2) {
-			memcpy (_time_data + n1, inpd, n2 * sizeof (float));
+
+		for (m = 0; m < _ninps; m++) {
+			X    = _inps[m];
+			inpd = _inpbuff[X->_inp];
+			act  = energy (inpd + i1, n1) + energy (inpd, n2) > _silence * _parsize;
+			if (X->_act[_ptind] != act) {
+				X->_act[_ptind] = act;
+				X->_nact += act ? 1 : -1;
+			}
+			nact += X->_nact;
+			++_nfft;
+			if (!act) {
+				/* the spectrum is not used, no need to clear it */
+				++_sfft;
+				continue;
+			}
+			fft_input (X, i1, n1, n2);
 		}
-		memset (_time_data + _parsize, 0, _parsize * sizeof (float));
-		fftwf_execute_dft_r2c (_plan_r2c, _time_data, X->_ffta[_ptind]);
 	}
 
-	for (Y = _out_list; Y; Y = Y->_next) {
-		memset (_freq_data, 0, (_parsize + 1) * sizeof (fftwf_complex));
-		for (M = Y->_list; M; M = M->_next) {
-			X = M->_inpn;
-			i = _ptind;
-			for (j = 0; j < _npar; j++) {
-				ffta = X->_ffta[i];
-				fftb = M->_link ? M->_link->_fftb[j] : M->_fftb[j];
+	for (o = 0; o < _nouts; o++) {
+		Y = _outs[o];
+		/* bins [0, nset) of _freq_data are initialized, the
+		 * first MAC term to reach a bin stores instead of adding */
+		nset = 0;
+		for (m = _omac[o]; m < _omac[o + 1] && nact > 0; m++) {
+			T = _macs + m;
+			X = _inps[T->_inp];
+			i = (_ptind + _npar - j0) % _npar;
+			for (j = j0; j < j1; j++) {
+				fftb = T->_fftb[j];
 				if (fftb) {
-					{
-						for (k = 0; k <= _parsize; k++) {
-							_freq_data[k][0] += ffta[k][0] * fftb[k][0] - ffta[k][1] * fftb[k][1];
-							_freq_data[k][1] += ffta[k][0] * fftb[k][1] + ffta[k][1] * fftb[k][0];
+					++_nmac;
+					if (X->_act[i]) {
+						nbin = T->_nbin[j];
+						ffta = X->_ffta[i];
+						_nbins += _parsize + 1;
+						_sbins += _parsize + 1 - nbin;
+						if (T->_gain == 1.f) {
+							mac_full (_freq_data, ffta, fftb, nset, nbin);
+						} else {
+							mac_gain (_freq_data, ffta, fftb, T->_gain, nset, nbin);
+						}
+						if (nset < nbin) {
+							nset = nbin;
 						}
+					} else {
+						++_smac;
 					}
 				}
 				if (i == 0) {
@@ -860,65 +1491,165 @@ Convlevel::process ()
 			}
 		}
 
-		fftwf_execute_dft_c2r (_plan_c2r, _freq_data, _time_data);
-		outd = Y->_buff[opi1];
-		for (k = 0; k < _parsize; k++) {
-			outd[k] += _time_data[k];
+		++_nfft;
+		if (nset == 0) {
+			/* no contribution, skip the inverse FFT */
+			++_sfft;
+			if (!_partial) {
+				memset (Y->_buff[opi2], 0, _parsize * sizeof (float));
+			}
+			continue;
 		}
-		outd = Y->_buff[opi2];
-		memcpy (outd, _time_data + _parsize, _parsize * sizeof (float));
+		if (nset <= _parsize) {
+			memset (_freq_data + nset, 0, (_parsize + 1 - nset) * sizeof (fftwf_complex));
+		}
+
+		ifft_output (Y, opi1, opi2, _partial);
 	}
 
+	if (partial) {
+		/* the new partition is processed when it is complete */
+		_partial = true;
+		return;
+	}
+	_partial = false;
 	_ptind++;
 	if (_ptind == _npar) {
 		_ptind = 0;
 	}
 }
 
+/* forward FFT of one input partition */
+void
+Convlevel::fft_input (Inpnode* X, uint32_t i1, uint32_t n1, uint32_t n2)
+{
+	float const* inpd = _inpbuff[X->_inp];
+
+	if (n1) {
+		memcpy (_time_data, inpd + i1, n1 * sizeof (float));
+	}
+	if (n2) {
+		memcpy (_time_data + n1, inpd, n2 * sizeof (float));
+	}
+	memset (_time_data + _parsize, 0, _parsize * sizeof (float));
+	fftwf_execute_dft_r2c (_plan_r2c, _time_data, X->_ffta[_ptind]);
+}
+
+/* inverse FFT of one output partition, overlap-add. The second
+ * half is stored, unless add is set: process (true) stored it. */
+void
+Convlevel::ifft_output (Outnode const* Y, uint32_t opi1, uint32_t opi2, bool add)
+{
+	uint32_t k;
+	float*   outd;
+
+	fftwf_execute_dft_c2r (_plan_c2r, _freq_data, _time_data);
+	outd = Y->_buff[opi2];
+	if (add) {
+		for (k = 0; k < _parsize; k++) {
+			outd[k] += _time_data[_parsize + k];
+		}
+	} else {
+		memcpy (outd, _time_data + _parsize, _parsize * sizeof (float));
+	}
+	outd = Y->_buff[opi1];
+	for (k = 0; k < _parsize; k++) {
+		outd[k] += _time_data[k];
+	}
+}
+
+float
+Convlevel::energy (float const* data, uint32_t n)
+{
+	uint32_t k;
+	float    e = 0;
+
+	for (k = 0; k < n; k++) {
+		e += data[k] * data[k];
+	}
+	return e;
+}
+
 int
-Convlevel::readout ()
+Convlevel::readout (uint64_t& outset)
 {
-	uint32_t       i;
+	uint32_t       i, o;
 	float *        p, *q;
 	Outnode const* Y;
 
+	bool late = false;
+
 	_outoffs += _outsize;
 	if (_outoffs == _parsize) {
 		_outoffs = 0;
-		if (_stat == ST_PROC) {
+		if (_stat == ST_PROC || _stat == ST_SYNC) {
 			while (_wait) {
-				_done.wait ();
+				if (_done.trywait ()) {
+					/* the previous cycle is not yet complete.
+					 * A short wait still fits the period */
+					const double t0 = time_now ();
+					_done.wait ();
+					late |= time_now () - t0 > _t_late;
+				}
 				_wait--;
 			}
 			if (++_opind == 3) {
 				_opind = 0;
 			}
-			_trig.post ();
-			_wait++;
+#ifdef WITH_LEVEL_STATS
+			_t_trig = time_now ();
+#endif
+			if (_sync || _stat == ST_SYNC) {
+				/* the same cycle as main (), the output is
+				 * read when the next partition starts */
+				process ();
+#ifdef WITH_LEVEL_STATS
+				const double dt = time_now () - _t_trig;
+				if (dt > _t_max) {
+					_t_max = dt;
+				}
+#endif
+			} else {
+				_trig.post ();
+				_wait++;
+			}
 		} else {
+#ifdef WITH_LEVEL_STATS
+			_t_trig = time_now ();
+#endif
 			process ();
+#ifdef WITH_LEVEL_STATS
+			const double dt = time_now () - _t_trig;
+			if (dt > _t_max) {
+				_t_max = dt;
+			}
+#endif
 			if (++_opind == 3) {
 				_opind = 0;
 			}
 		}
 	}
 
-	for (Y = _out_list; Y; Y = Y->_next) {
+	for (o = 0; o < _nouts; o++) {
+		Y = _outs[o];
 		p = Y->_buff[_opind] + _outoffs;
 		q = _outbuff[Y->_out];
-		for (i = 0; i < _outsize; i++) {
-			q[i] += p[i];
+		if (outset & (1ULL << Y->_out)) {
+			for (i = 0; i < _outsize; i++) {
+				q[i] += p[i];
+			}
+		} else {
+			memcpy (q, p, _outsize * sizeof (float));
+			outset |= 1ULL << Y->_out;
 		}
 	}
 
-	return (_wait > 1) ? _bits : 0;
+	return late ? _bits : 0;
 }
 
 int
-Convlevel::readtail (uint32_t n_samples)
+Convlevel::readtail (uint32_t n_samples, uint64_t& outset)
 {
-	Outnode const* Y;
-
 	uint32_t opind   = _opind;
 	uint32_t outoffs = _outoffs + _outsize;
 	if (outoffs == _parsize) {
@@ -931,13 +1662,26 @@ Convlevel::readtail (uint32_t n_samples)
 		if (++opind == 3) {
 			opind = 0;
 		}
+		if (_stat != ST_PROC && _stat != ST_SYNC && !_partial && _npar > 1) {
+			/* readout () processes this level when the partition is
+			 * complete, without latency. Until then the output buffer
+			 * only holds the overlap of the last partition. The terms
+			 * of the previous input partitions are added here, once. */
+			process (true);
+		}
 	}
 
-	for (Y = _out_list; Y; Y = Y->_next) {
-		float const* const p = Y->_buff[opind] + outoffs;
-		float* const       q = _outbuff[Y->_out];
-		for (uint32_t i = 0; i < n_samples; i++) {
-			q[i] += p[i];
+	for (uint32_t o = 0; o < _nouts; o++) {
+		Outnode const* const Y = _outs[o];
+		float const* const   p = Y->_buff[opind] + outoffs;
+		float* const         q = _outbuff[Y->_out];
+		if (outset & (1ULL << Y->_out)) {
+			for (uint32_t i = 0; i < n_samples; i++) {
+				q[i] += p[i];
+			}
+		} else {
+			memcpy (q, p, n_samples * sizeof (float));
+			outset |= 1ULL << Y->_out;
 		}
 	}
 	return 0;
@@ -946,7 +1690,75 @@ Convlevel::readtail (uint32_t n_samples)
 void
 Convlevel::print (FILE* F)
 {
-	fprintf (F, "prio = %4d, offs = %6d,  parsize = %5d,  npar = %3d\n", _prio, _offs, _parsize, _npar);
+#ifdef WITH_LEVEL_STATS
+	fprintf (F, "prio = %4d, offs = %6d,  parsize = %5d,  npar = %3d,  tmax = %7.1f us", _prio, _offs, _parsize, _npar, 1e6 * _t_max);
+#else
+	fprintf (F, "prio = %4d, offs = %6d,  parsize = %5d,  npar = %3d", _prio, _offs, _parsize, _npar);
+#endif
+	if (_nfft > 0) {
+		fprintf (F, ",  skipped: fft %5.1f%%, mac %5.1f%%", 100.0 * _sfft / _nfft, _nmac > 0 ? 100.0 * _smac / _nmac : 0);
+	}
+	if (_nbins > 0) {
+		fprintf (F, ", bins %5.1f%%", 100.0 * _sbins / _nbins);
+	}
+	fprintf (F, "\n");
+}
+
+/* Compile the node lists into flat arrays for process () */
+void
+Convlevel::compile (void)
+{
+	Inpnode*       X;
+	Outnode*       Y;
+	Macnode const* M;
+	Macnode const* B;
+	Macterm*       T;
+	uint32_t       i, n;
+
+	_ninps = 0;
+	for (X = _inp_list; X; X = X->_next) {
+		++_ninps;
+	}
+	_nouts = 0;
+	n      = 0;
+	for (Y = _out_list; Y; Y = Y->_next) {
+		++_nouts;
+		for (M = Y->_list; M; M = M->_next) {
+			++n;
+		}
+	}
+
+	_inps = (Inpnode**)_arena->alloc (_ninps * sizeof (Inpnode*));
+	_outs = (Outnode**)_arena->alloc (_nouts * sizeof (Outnode*));
+	_omac = (uint32_t*)_arena->alloc ((_nouts + 1) * sizeof (uint32_t));
+	_macs = (Macterm*)_arena->alloc (n * sizeof (Macterm));
+
+	i = 0;
+	for (X = _inp_list; X; X = X->_next) {
+		_inps[i++] = X;
+	}
+
+	i = 0;
+	n = 0;
+	for (Y = _out_list; Y; Y = Y->_next) {
+		_outs[i] = Y;
+		_omac[i] = n;
+		for (M = Y->_list; M; M = M->_next) {
+			B = M->_link ? M->_link : M;
+			if (!B->_fftb) {
+				continue;
+			}
+			T = _macs + n++;
+			for (T->_inp = 0; _inps[T->_inp] != M->_inpn; T->_inp++) {
+				;
+			}
+			T->_fftb = B->_fftb;
+			T->_nbin = B->_nbin;
+			T->_gain = M->_gain;
+		}
+		++i;
+	}
+	_omac[i] = n;
 }
 
 Macnode*
@@ -963,10 +1775,10 @@ Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 		if (!create) {
 			return 0;
 		}
-		X         = new Inpnode (inp);
+		X         = new (_arena->alloc (sizeof (Inpnode))) Inpnode (inp);
 		X->_next  = _inp_list;
 		_inp_list = X;
-		X->alloc_ffta (_npar, _parsize);
+		X->alloc_ffta (_npar, _parsize, _arena);
 	}
 
 	for (Y = _out_list; Y && (Y->_out != out); Y = Y->_next) {
@@ -976,7 +1788,7 @@ Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 		if (!create) {
 			return 0;
 		}
-		Y         = new Outnode (out, _parsize);
+		Y         = new (_arena->alloc (sizeof (Outnode))) Outnode (out, _parsize, _arena);
 		Y->_next  = _out_list;
 		_out_list = Y;
 	}
@@ -988,7 +1800,7 @@ Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 		if (!create) {
 			return 0;
 		}
-		M        = new Macnode (X);
+		M        = new (_arena->alloc (sizeof (Macnode))) Macnode (X);
 		M->_next = Y->_list;
 		Y->_list = M;
 	}
@@ -999,91 +1811,50 @@ Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 Inpnode::Inpnode (uint16_t inp)
 	: _next (0)
 	, _ffta (0)
+	, _act (0)
 	, _npar (0)
+	, _nact (0)
 	, _inp (inp)
 {
 }
 
-Inpnode::~Inpnode (void)
-{
-	free_ffta ();
-}
-
 void
-Inpnode::alloc_ffta (uint16_t npar, int32_t size)
+Inpnode::alloc_ffta (uint32_t npar, int32_t size, Convarena* arena)
 {
 	_npar = npar;
-	_ffta = new fftwf_complex*[_npar];
-	for (int i = 0; i < _npar; i++) {
-		_ffta[i] = calloc_complex (size + 1);
+	_nact = 0;
+	_ffta = (fftwf_complex**)arena->alloc (_npar * sizeof (fftwf_complex*));
+	_act  = (bool*)arena->alloc (_npar * sizeof (bool));
+	for (uint32_t i = 0; i < _npar; i++) {
+		_ffta[i] = (fftwf_complex*)arena->alloc ((size + 1) * sizeof (fftwf_complex));
 	}
 }
 
-void
-Inpnode::free_ffta (void)
-{
-	if (!_ffta) {
-		return;
-	}
-	for (uint16_t i = 0; i < _npar; i++) {
-		fftwf_free (_ffta[i]);
-	}
-	delete[] _ffta;
-	_ffta = 0;
-	_npar = 0;
-}
-
 Macnode::Macnode (Inpnode* inpn)
 	: _next (0)
 	, _inpn (inpn)
 	, _link (0)
+	, _gain (1)
 	, _fftb (0)
+	, _nbin (0)
 	, _npar (0)
 {
 }
 
-Macnode::~Macnode (void)
-{
-	free_fftb ();
-}
-
 void
-Macnode::alloc_fftb (uint16_t npar)
+Macnode::alloc_fftb (uint32_t npar, Convarena* arena)
 {
 	_npar = npar;
-	_fftb = new fftwf_complex*[_npar];
-	for (uint16_t i = 0; i < _npar; i++) {
-		_fftb[i] = 0;
-	}
-}
-
-void
-Macnode::free_fftb (void)
-{
-	if (!_fftb) {
-		return;
-	}
-	for (uint16_t i = 0; i < _npar; i++) {
-		fftwf_free (_fftb[i]);
-	}
-	delete[] _fftb;
-	_fftb = 0;
-	_npar = 0;
+	_fftb = (fftwf_complex**)arena->alloc (_npar * sizeof (fftwf_complex*));
+	_nbin = (uint32_t*)arena->alloc (_npar * sizeof (uint32_t));
 }
 
-Outnode::Outnode (uint16_t out, int32_t size)
+Outnode::Outnode (uint16_t out, int32_t size, Convarena* arena)
 	: _next (0)
 	, _list (0)
 	, _out (out)
 {
-	_buff[0] = calloc_real (size);
-	_buff[1] = calloc_real (size);
-	_buff[2] = calloc_real (size);
-}
-
-Outnode::~Outnode (void)
-{
-	fftwf_free (_buff[0]);
-	fftwf_free (_buff[1]);
-	fftwf_free (_buff[2]);
+	_buff[0] = (float*)arena->alloc (size * sizeof (float));
+	_buff[1] = (float*)arena->alloc (size * sizeof (float));
+	_buff[2] = (float*)arena->alloc (size * sizeof (float));
 }
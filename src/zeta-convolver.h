@@ -16,12 +16,22 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 // ----------------------------------------------------------------------------
+// This is a customized version of Fons Adriaensen's libzita-convolver,
+// see zeta-convolver.cc for the changes.
+//
+// Note that FL_LATE and _latecnt differ from upstream: a level cycle
+// that is not complete is always waited for, the output is never
+// dropped. Only waits longer than the period given to start_process()
+// are counted as late, so a count is not a lost cycle.
+//
+// ----------------------------------------------------------------------------
 
 #ifndef _ZETA_CONVOLVER_H
 #define _ZETA_CONVOLVER_H
 
 #include <fftw3.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace LV2ZetaConvolver
@@ -162,19 +172,74 @@ private:
 
 // ----------------------------------------------------------------------------
 
+/* Chunked memory pool. All buffers, nodes, spectra and the flat routing
+ * graph of a Convproc are allocated from it, and released at once.
+ * Chunks are zeroed, and thereby pre-faulted, when they are created. */
+class Convarena
+{
+private:
+	friend class Convproc;
+	friend class Convlevel;
+	friend class Inpnode;
+	friend class Macnode;
+	friend class Outnode;
+
+	enum {
+		ALIGN      = 64,
+		CHUNK      = 1 << 20,
+		CHUNK_HUGE = 1 << 23 // chunk size when using huge pages
+	};
+
+	struct Chunk {
+		Chunk* _next;
+		char*  _mem;  // as allocated
+		char*  _base; // aligned
+		size_t _size;
+		size_t _used;
+		size_t _len;  // length of the mapping
+		bool   _lock; // chunk is locked in memory
+	};
+
+	Convarena (void);
+	~Convarena (void);
+
+	static size_t round (size_t size)
+	{
+		return (size + ALIGN - 1) & ~((size_t)ALIGN - 1);
+	}
+
+	/* zero-initialized and aligned, throws Converror */
+	void* alloc (size_t size);
+	/* add a chunk for at least the given size */
+	void  reserve (size_t size);
+	/* lock all chunks in memory */
+	void  lock (void);
+	void  unlock (void);
+	void  clear (void);
+
+	Chunk* newchunk (size_t size);
+
+	Chunk*   _list;
+	size_t   _bytes;  // size of all chunks
+	size_t   _locked; // size of all locked chunks
+	uint32_t _count;  // number of allocations
+	uint32_t _nchunk; // number of chunks
+	bool     _huge;   // use transparent huge pages
+};
+
 class Inpnode
 {
 private:
 	friend class Convlevel;
 
 	Inpnode (uint16_t inp);
-	~Inpnode (void);
-	void alloc_ffta (uint16_t npar, int32_t size);
-	void free_ffta (void);
+	void alloc_ffta (uint32_t npar, int32_t size, Convarena* arena);
 
 	Inpnode*        _next;
 	fftwf_complex** _ffta;
-	uint16_t        _npar;
+	bool*           _act;  // partition is not silent
+	uint32_t        _npar;
+	uint32_t        _nact; // number of active partitions
 	uint16_t        _inp;
 };
 
@@ -184,15 +249,15 @@ private:
 	friend class Convlevel;
 
 	Macnode (Inpnode* inpn);
-	~Macnode (void);
-	void alloc_fftb (uint16_t npar);
-	void free_fftb (void);
+	void alloc_fftb (uint32_t npar, Convarena* arena);
 
 	Macnode*        _next;
 	Inpnode*        _inpn;
-	Macnode*        _link;
+	Macnode*        _link; // use the spectra of this node
+	float           _gain; // applied to the spectra of _link
 	fftwf_complex** _fftb;
-	uint16_t        _npar;
+	uint32_t*       _nbin; // number of significant bins per partition
+	uint32_t        _npar;
 };
 
 class Outnode
@@ -200,8 +265,7 @@ class Outnode
 private:
 	friend class Convlevel;
 
-	Outnode (uint16_t out, int32_t size);
-	~Outnode (void);
+	Outnode (uint16_t out, int32_t size, Convarena* arena);
 
 	Outnode* _next;
 	Macnode* _list;
@@ -209,6 +273,18 @@ private:
 	uint16_t _out;
 };
 
+/* A MAC term of the flat routing graph, see Convlevel::compile() */
+class Macterm
+{
+private:
+	friend class Convlevel;
+
+	uint32_t        _inp;  // index into Convlevel::_inps
+	fftwf_complex** _fftb; // spectra of all partitions
+	uint32_t*       _nbin; // number of significant bins per partition
+	float           _gain; // of a linked path
+};
+
 class Converror
 {
 public:
@@ -232,23 +308,28 @@ private:
 	enum {
 		OPT_FFTW_MEASURE = 1,
 		OPT_VECTOR_MODE  = 2,
-		OPT_LATE_CONTIN  = 4
+		OPT_LATE_CONTIN  = 4,
+		OPT_MEMLOCK      = 8,
+		OPT_HUGEPAGE     = 16,
+		OPT_NO_THREADS   = 32
 	};
 
 	enum {
 		ST_IDLE,
 		ST_TERM,
-		ST_PROC
+		ST_PROC,
+		ST_SYNC // started, without a thread, see OPT_NO_THREADS
 	};
 
 	Convlevel (void);
 	~Convlevel (void);
 
-	void configure (int      prio,
-	                uint32_t offs,
-	                uint32_t npar,
-	                uint32_t parsize,
-	                uint32_t options);
+	void configure (int        prio,
+	                uint32_t   offs,
+	                uint32_t   npar,
+	                uint32_t   parsize,
+	                uint32_t   options,
+	                Convarena* arena);
 
 	void impdata_write (uint32_t inp,
 	                    uint32_t out,
@@ -261,30 +342,74 @@ private:
 	void impdata_clear (uint32_t inp,
 	                    uint32_t out);
 
+	void impdata_link (uint32_t inp1,
+	                   uint32_t out1,
+	                   uint32_t inp2,
+	                   uint32_t out2,
+	                   float    gain);
+
+	void impdata_energy (uint32_t  inp,
+	                     uint32_t  out,
+	                     double&   etot,
+	                     uint32_t& npar);
+
+	void impdata_sparsify (uint32_t inp,
+	                       uint32_t out,
+	                       double   emax);
+
 	void reset (uint32_t inpsize,
 	            uint32_t outsize,
 	            float**  inpbuff,
 	            float**  outbuff);
 
+	void flush (void);
+	void clear (void);
+
 	bool start (int absprio, int policy, double period_ns);
 
-	void process ();
+	/* partial: add the terms of the previous input partitions to the
+	 * output of the new one, which is not yet complete, see readtail () */
+	void process (bool partial = false);
+
+	void fft_input (Inpnode* X, uint32_t i1, uint32_t n1, uint32_t n2);
+	void ifft_output (Outnode const* Y, uint32_t opi1, uint32_t opi2, bool add);
+
+	/* add the output of this level, outset: bitmask of
+	 * output buffers that were already written this cycle */
+	int readout (uint64_t& outset);
+	int readtail (uint32_t n_samples, uint64_t& outset);
+
+	static float energy (float const* data, uint32_t n);
 
-	int readout ();
-	int readtail (uint32_t n_samples);
+	double binenergy (fftwf_complex const* fftb, uint32_t k0, uint32_t k1) const;
+
+	/* level holds no impulse response data */
+	bool empty (void) const
+	{
+		return _inp_list == 0;
+	}
 
 	void stop (void);
 
 	void cleanup (void);
 
+	/* size of the buffers allocated by configure () */
+	static size_t workspace (uint32_t parsize, uint32_t npar, uint32_t ninp, uint32_t nout, uint32_t options);
+
 	void print (FILE* F);
 
+#ifdef WITH_LEVEL_STATS
+	void reset_stats (void);
+#endif
+
 	static void* static_main (void* arg);
 
 	void main (void);
 
 	Macnode* findmacnode (uint32_t inp, uint32_t out, bool create);
 
+	void compile (void);
+
 	volatile uint32_t _stat;      // current processing state
 	int               _prio;      // relative priority
 	uint32_t          _offs;      // offset from start of impulse response
@@ -304,6 +429,13 @@ private:
 	ZCsema            _done;      // sema used to wait for a cycle
 	Inpnode*          _inp_list;  // linked list of active inputs
 	Outnode*          _out_list;  // linked list of active outputs
+	Convarena*        _arena;     // memory of nodes and spectra
+	Inpnode**         _inps;      // flat graph: active inputs
+	Outnode**         _outs;      // flat graph: active outputs
+	Macterm*          _macs;      // flat graph: MAC terms, grouped by output
+	uint32_t*         _omac;      // flat graph: first MAC term of each output
+	uint32_t          _ninps;     // flat graph: number of inputs
+	uint32_t          _nouts;     // flat graph: number of outputs
 	fftwf_plan        _plan_r2c;  // FFTW plan, forward FFT
 	fftwf_plan        _plan_c2r;  // FFTW plan, inverse FFT
 	float*            _time_data; // workspace
@@ -311,6 +443,20 @@ private:
 	fftwf_complex*    _freq_data; // workspace
 	float**           _inpbuff;   // array of shared input buffers
 	float**           _outbuff;   // array of shared output buffers
+	float             _silence;   // mean square below which input is silent
+	bool              _sync;      // process cycles in readout (), see Convproc::set_sync ()
+	bool              _partial;   // process (true) was called for the current partition
+	double            _t_late;    // a longer wait for a cycle is reported as late [sec]
+	uint64_t          _nfft;      // count of FFTs
+	uint64_t          _nmac;      // count of partition MACs
+	uint64_t          _sfft;      // count of skipped FFTs
+	uint64_t          _smac;      // count of skipped partition MACs
+	uint64_t          _nbins;     // count of bins in partition MACs
+	uint64_t          _sbins;     // count of skipped insignificant bins
+#ifdef WITH_LEVEL_STATS
+	double            _t_trig;    // time when the current cycle was triggered
+	double            _t_max;     // worst-case cycle completion time
+#endif
 };
 
 // ----------------------------------------------------------------------------
@@ -333,23 +479,40 @@ public:
 		FL_LOAD = 0x01000000
 	};
 
+	/* OPT_MEMLOCK: lock all memory when processing (re)starts, not by
+	 * prepare_process(). A failed lock is not fatal, the memory was
+	 * pre-faulted, see memory_stats()
+	 * OPT_HUGEPAGE: back the memory by transparent huge pages
+	 * OPT_NO_THREADS: process all levels in the thread that calls
+	 * process (), like set_sync (true) but without starting threads.
+	 * The output does not depend on timing, process () is never late */
 	enum {
 		OPT_FFTW_MEASURE = Convlevel::OPT_FFTW_MEASURE,
 		OPT_VECTOR_MODE  = Convlevel::OPT_VECTOR_MODE,
-		OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN
+		OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN,
+		OPT_MEMLOCK      = Convlevel::OPT_MEMLOCK,
+		OPT_HUGEPAGE     = Convlevel::OPT_HUGEPAGE,
+		OPT_NO_THREADS   = Convlevel::OPT_NO_THREADS
 	};
 
 	enum {
 		MAXINP   = 64,
 		MAXOUT   = 64,
-		MAXLEV   = 8,
+		MAXLEV   = 16,
 		MINPART  = 64,
-		MAXPART  = 8192,
+		MAXPART  = 131072,
 		MAXDIVIS = 16,
 		MINQUANT = 16,
 		MAXQUANT = 8192
 	};
 
+	/* partition size up to which the FFT cost per sample is constant */
+	enum { FFTCOST_KNEE = 8192 };
+
+	/* FFT cost per sample of a partition of the given size, relative
+	 * to the constant cost used by configure () up to FFTCOST_KNEE */
+	static float fftcost_scale (uint32_t size);
+
 	uint32_t state (void) const
 	{
 		return _state;
@@ -383,10 +546,40 @@ public:
 	int impdata_clear (uint32_t inp,
 	                   uint32_t out);
 
+	/* use the impulse response of inp1 -> out1, scaled
+	 * by gain, for inp2 -> out2 without a copy */
+	int impdata_link (uint32_t inp1,
+	                  uint32_t out1,
+	                  uint32_t inp2,
+	                  uint32_t out2,
+	                  float    gain = 1.0f);
+
 	void set_options (uint32_t options);
 
+	/* mean square power below which an input block is treated as silent */
+	void set_silence_threshold (float power);
+
+	/* Fraction of the impulse response energy that may be discarded
+	 * by omitting high frequency bins of each partition from the MAC.
+	 * This is applied by prepare_process(), 0 disables it. */
+	void set_sparse_threshold (float err);
+
+	/* Process the cycles of all levels in the thread that calls
+	 * process (), instead of the level threads. The output is the
+	 * same, this can be changed between calls to process (). */
+	void set_sync (bool sync);
+
 	int reset (void);
 
+	/* Wait for pending cycles and clear all buffers. The caller must
+	 * ensure that process() is not called concurrently. */
+	int flush (void);
+
+	/* Prepare the IR data for processing, without starting the level
+	 * threads, which restart_process() does later. start_process()
+	 * calls this unless it was called before. */
+	int prepare_process (void);
+
 	int start_process (int abspri, int policy, double period_ns);
 	int restart_process (int abspri, int policy, double period_ns);
 
@@ -402,6 +595,40 @@ public:
 
 	void print (FILE* F = stdout);
 
+	/* memory used by the engine: total and locked bytes,
+	 * and the number of allocations */
+	void memory_stats (size_t& bytes, size_t& locked, uint32_t& count) const;
+
+	/* Unlock the memory of a stopped engine, e.g. one that is kept
+	 * for later use. With OPT_MEMLOCK, restart_process() locks it again */
+	void unlock_memory (void);
+
+	/* FFTs, partition MACs and MAC bins of all levels since
+	 * start_process (), and how many of them were skipped, see
+	 * set_silence_threshold () and set_sparse_threshold () */
+	struct SkipStats {
+		SkipStats () : nfft (0), sfft (0), nmac (0), smac (0), nbins (0), sbins (0) {}
+		uint64_t nfft;
+		uint64_t sfft;
+		uint64_t nmac;
+		uint64_t smac;
+		uint64_t nbins;
+		uint64_t sbins;
+	};
+	void skip_stats (SkipStats&) const;
+
+#ifdef WITH_LEVEL_STATS
+	uint32_t nlevels (void) const
+	{
+		return _nlevels;
+	}
+
+	/* partition size, number of partitions and worst-case
+	 * cycle completion time [sec] of the given level */
+	void level_stats (uint32_t lev, uint32_t& parsize, uint32_t& npar, double& t_max) const;
+	void reset_stats (void);
+#endif
+
 private:
 	uint32_t   _state;           // current state
 	float*     _inpbuff[MAXINP]; // input buffers
@@ -416,10 +643,17 @@ private:
 	uint32_t   _maxpart;         // largest allowed partition size
 	uint32_t   _nlevels;         // number of partition sizes
 	uint32_t   _inpsize;         // size of input buffers
-	uint32_t   _latecnt;         // count of cycles ending too late
+	bool       _prepared;        // see prepare_process ()
+	uint32_t   _latecnt;         // count of waits longer than a period, see above
+	float      _silence;         // silence threshold
+	float      _sparse;          // max. relative error of sparse MAC
+	bool       _sync;            // see set_sync ()
 	Convlevel* _convlev[MAXLEV]; // array of processors
+	Convarena  _arena;           // memory of all levels
 	void*      _dummy[64];
 
+	void sparsify (void);
+
 	static float _mac_cost;
 	static float _fft_cost;
 };
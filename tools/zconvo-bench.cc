@@ -0,0 +1,1008 @@
+/* zconvo-bench -- measure the convolution engine without a host
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Run a Convolver, as the plugin does, with synthetic input for a given
+ * IR file or a synthetic IR. The time of each run_*() call is measured,
+ * and a summary is printed as JSON, e.g. to track regressions between
+ * releases:
+ *  - mean, 99th percentile and max. time per period,
+ *  - periods that took longer than their duration (overruns),
+ *  - engine cycles that waited longer than a period for a background
+ *    level (late),
+ *  - the number of threads, the engine memory and the max. RSS.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+#include "../src/convolver.h"
+
+using ZeroConvoLV2::Convolver;
+
+struct Setup {
+	Convolver::IRChannelConfig irc;
+	const char*                cfg_name;
+	uint32_t                   n_in;
+	uint32_t                   n_out;
+	uint32_t                   ir_chn; // channels of the synthetic IR
+	uint32_t                   irlen;
+	std::string                ir_file;
+	uint32_t                   rate;
+	uint32_t                   block_size;
+	bool                       random_blocks;
+	bool                       buffered;
+	bool                       lowrate_tail;
+	bool                       freewheel;
+	bool                       sync;
+	double                     duration;
+	int                        priority;
+	uint32_t                   seed;
+};
+
+static double
+now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static float
+noise (uint32_t& seed)
+{
+	seed = seed * 1664525 + 1013904223;
+	return (seed >> 8) / 8388608.f - 1.f;
+}
+
+/* Exponentially decaying noise, -60dB at the end, like zconvo-tune,
+ * n_chn channels interleaved */
+static void
+synthetic_ir (uint32_t n_chn, uint32_t len, std::vector<float>& ir)
+{
+	ir.resize (n_chn * len);
+	uint32_t seed = 42;
+	for (uint32_t i = 0; i < len; ++i) {
+		for (uint32_t c = 0; c < n_chn; ++c) {
+			ir[i * n_chn + c] = .5f * noise (seed) * expf (-6.9f * i / len);
+		}
+	}
+}
+
+/* The Convolver reads IR files, write it to a temporary one */
+static bool
+write_ir (std::vector<float> const& ir, uint32_t n_chn, uint32_t rate, std::string& path)
+{
+	char tmpl[] = "/tmp/zconvo-bench-XXXXXX";
+	int  fd     = mkstemp (tmpl);
+	if (fd < 0) {
+		return false;
+	}
+
+	SF_INFO info;
+	memset (&info, 0, sizeof (info));
+	info.samplerate = rate;
+	info.channels   = n_chn;
+	info.format     = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+	SNDFILE* sf = sf_open_fd (fd, SFM_WRITE, &info, 1);
+	if (!sf) {
+		unlink (tmpl);
+		return false;
+	}
+
+	const sf_count_t len = ir.size () / n_chn;
+	const bool       ok  = sf_writef_float (sf, &ir[0], len) == len;
+	sf_close (sf);
+	if (!ok) {
+		unlink (tmpl);
+		return false;
+	}
+	path = tmpl;
+	return true;
+}
+
+static int
+count_threads (void)
+{
+#ifdef __linux__
+	DIR* d = opendir ("/proc/self/task");
+	if (!d) {
+		return -1;
+	}
+	int            n = 0;
+	struct dirent* e;
+	while ((e = readdir (d))) {
+		if (e->d_name[0] != '.') {
+			++n;
+		}
+	}
+	closedir (d);
+	return n;
+#else
+	return -1;
+#endif
+}
+
+static long
+max_rss_kib (void)
+{
+	struct rusage ru;
+	if (getrusage (RUSAGE_SELF, &ru)) {
+		return -1;
+	}
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+static std::string
+json_string (std::string const& str)
+{
+	std::string rv = "\"";
+	for (std::string::const_iterator i = str.begin (); i != str.end (); ++i) {
+		if (*i == '"' || *i == '\\') {
+			rv += '\\';
+			rv += *i;
+		} else if ((unsigned char)*i < 0x20) {
+			char esc[8];
+			snprintf (esc, sizeof (esc), "\\u%04x", (unsigned char)*i);
+			rv += esc;
+		} else {
+			rv += *i;
+		}
+	}
+	return rv + "\"";
+}
+
+static void
+run (Convolver* clv, Setup const& s, float* const* buf, uint32_t n_samples)
+{
+	switch (s.irc) {
+		case Convolver::Mono:
+			if (s.buffered) {
+				clv->run_buffered_mono (buf[0], n_samples);
+			} else {
+				clv->run_mono (buf[0], n_samples);
+			}
+			break;
+		case Convolver::Matrix:
+			clv->run_buffered_multi (buf, n_samples);
+			break;
+		default:
+			if (s.buffered) {
+				clv->run_buffered_stereo (buf[0], buf[1], n_samples);
+			} else {
+				clv->run_stereo (buf[0], buf[1], n_samples);
+			}
+			break;
+	}
+}
+
+/* Channel configs of the plugin variants, processed by verify_report() */
+struct VerifyCase {
+	const char*                name;
+	Convolver::IRChannelConfig irc;
+	uint32_t                   n_in;
+	uint32_t                   n_out;
+	uint32_t                   ir_chn;
+	bool                       sum_inputs;
+	bool                       settings; ///< use gain, pre_delay, channel_gain and channel_delay
+};
+
+static const VerifyCase verify_cases[] = {
+	{ "mono", Convolver::Mono, 1, 1, 1, false, false },
+	{ "mono2stereo", Convolver::MonoToStereo, 1, 2, 2, false, false },
+	{ "stereo", Convolver::Stereo, 2, 2, 2, false, false },
+	{ "truestereo", Convolver::Stereo, 2, 2, 4, false, false },
+	{ "stereo+sum", Convolver::Stereo, 2, 2, 2, true, false },
+	{ "truestereo+sum", Convolver::Stereo, 2, 2, 4, true, false },
+	{ "truestereo+dly", Convolver::Stereo, 2, 2, 4, false, true },
+	{ "3x2", Convolver::Matrix, 3, 2, 6, false, false },
+};
+
+/* samples per run_*() call, 0: random 1 .. 256 */
+static const uint32_t verify_blocks[] = { 1, 17, 63, 64, 100, 256, 0 };
+
+static Convolver::IRSettings
+verify_settings (VerifyCase const& v)
+{
+	Convolver::IRSettings irs;
+	irs.sum_inputs = v.sum_inputs;
+	if (v.settings) {
+		irs.gain             = .8f;
+		irs.pre_delay        = 37;
+		irs.channel_gain[1]  = .5f;
+		irs.channel_gain[2]  = -.25f;
+		irs.channel_gain[3]  = 0.f;
+		irs.channel_delay[1] = 3;
+		irs.channel_delay[2] = 70;
+		irs.channel_delay[3] = 11;
+	}
+	return irs;
+}
+
+/* Direct convolution of all IR channels. With summed inputs both inputs
+ * are the same. IR channel c: in c -> out c for a stereo IR with the
+ * Stereo config, otherwise in c / n_out -> out c % n_out.
+ */
+static void
+verify_reference (VerifyCase const& v, Convolver::IRSettings const& irs, std::vector<float> const& ir, uint32_t ir_len,
+                  std::vector<std::vector<float> > const& x, std::vector<std::vector<double> >& y)
+{
+	const uint32_t n = x[0].size ();
+	y.assign (v.n_out, std::vector<double> (n, 0.0));
+
+	for (uint32_t c = 0; c < v.ir_chn; ++c) {
+		const bool     direct = v.irc == Convolver::Stereo && v.ir_chn == 2;
+		const uint32_t inp    = direct ? c : c / v.n_out;
+		const uint32_t out    = direct ? c : c % v.n_out;
+		const double   g      = irs.gain * (c < 4 ? irs.channel_gain[c] : 1.f);
+		const uint32_t d      = irs.pre_delay + (c < 4 ? irs.channel_delay[c] : 0);
+
+		std::vector<float> const& in = x[v.sum_inputs ? 0 : inp];
+		for (uint32_t t = d; t < n; ++t) {
+			const uint32_t kmax = std::min (ir_len, t - d + 1);
+			double         acc  = 0;
+			for (uint32_t k = 0; k < kmax; ++k) {
+				acc += (double)ir[k * v.ir_chn + c] * in[t - d - k];
+			}
+			y[out][t] += g * acc;
+		}
+	}
+}
+
+/* Process the input with the given block-size pattern, return the
+ * output aligned to the input */
+static bool
+verify_run (VerifyCase const& v, std::string const& ir_path, uint32_t rate, bool buffered, bool sync, uint32_t block,
+            std::vector<std::vector<float> > const& x, std::vector<std::vector<float> >& y)
+{
+	Convolver* clv = NULL;
+	try {
+		clv = new Convolver (ir_path, rate, SCHED_OTHER, 0, v.irc, verify_settings (v), v.n_in, v.n_out);
+		clv->reconfigure (256);
+	} catch (std::exception const& e) {
+		fprintf (stderr, "Cannot load IR: %s\n", e.what ());
+	}
+
+	if (!clv || !clv->ready ()) {
+		delete clv;
+		return false;
+	}
+
+	clv->set_output_gain (0.f, 1.f, false);
+	clv->set_freewheel (sync);
+
+	Setup s;
+	s.irc      = v.irc;
+	s.buffered = buffered;
+
+	const uint32_t n     = x[0].size ();
+	const uint32_t n_buf = std::max (v.n_in, v.n_out);
+	const uint32_t lat   = buffered ? clv->latency () : 0;
+
+	std::vector<std::vector<float> > data (n_buf, std::vector<float> (256));
+	std::vector<float*>              buf (n_buf);
+	for (uint32_t i = 0; i < n_buf; ++i) {
+		buf[i] = &data[i][0];
+	}
+
+	y.assign (v.n_out, std::vector<float> (n, 0.f));
+
+	uint32_t seed = 1;
+	for (uint32_t pos = 0; pos < n + lat;) {
+		uint32_t n_samples = block;
+		if (block == 0) {
+			seed      = seed * 1664525 + 1013904223;
+			n_samples = 1 + (seed >> 8) % 256;
+		}
+
+		for (uint32_t i = 0; i < n_buf; ++i) {
+			/* the plugin copies the input to both channels when
+			 * inputs are summed, and for MonoToStereo */
+			const uint32_t xi = v.sum_inputs || v.n_in == 1 ? 0 : i;
+			for (uint32_t k = 0; k < n_samples; ++k) {
+				data[i][k] = (i < v.n_in || v.n_in == 1) && pos + k < n ? x[xi][pos + k] : 0.f;
+			}
+		}
+
+		run (clv, s, &buf[0], n_samples);
+
+		for (uint32_t o = 0; o < v.n_out; ++o) {
+			for (uint32_t k = 0; k < n_samples; ++k) {
+				if (pos + k >= lat && pos + k - lat < n) {
+					y[o][pos + k - lat] = data[o][k];
+				}
+			}
+		}
+		pos += n_samples;
+	}
+
+	delete clv;
+	return true;
+}
+
+static double
+verify_snr (std::vector<std::vector<double> > const& ref, std::vector<std::vector<float> > const& y)
+{
+	double sig = 0;
+	double err = 0;
+	for (size_t o = 0; o < ref.size (); ++o) {
+		for (size_t i = 0; i < ref[o].size (); ++i) {
+			sig += ref[o][i] * ref[o][i];
+			err += (ref[o][i] - y[o][i]) * (ref[o][i] - y[o][i]);
+		}
+	}
+	return err > 0 ? 10 * log10 (sig / err) : HUGE_VAL;
+}
+
+/* With summed inputs a single engine input is used, and the IR channels
+ * of each output are added. The output must be the same as with the
+ * summed signal on both inputs, also with blocks that are smaller than
+ * the engine's quantum, where the time-domain head of each path is used.
+ */
+static bool
+verify_dual (VerifyCase const& v, uint32_t ir_len, std::string const& ir_path, uint32_t rate,
+             std::vector<std::vector<float> > const& x)
+{
+	static const uint32_t dual_blocks[] = { 1, 17, 63 };
+
+	VerifyCase dual = v;
+	dual.sum_inputs = false;
+
+	/* x[0] is the sum, see verify_report() */
+	const std::vector<std::vector<float> > xd (2, x[0]);
+
+	bool ok = true;
+	for (int mode = 0; mode < 2; ++mode) {
+		const bool buffered = mode == 0;
+		for (size_t b = 0; b < sizeof (dual_blocks) / sizeof (dual_blocks[0]); ++b) {
+			std::vector<std::vector<float> > y;
+			std::vector<std::vector<float> > yd;
+
+			if (!verify_run (v, ir_path, rate, buffered, false, dual_blocks[b], x, y)
+			    || !verify_run (dual, ir_path, rate, buffered, false, dual_blocks[b], xd, yd)) {
+				fprintf (stderr, "Cannot configure convolver\n");
+				return false;
+			}
+
+			std::vector<std::vector<double> > ref (yd.size ());
+			for (size_t o = 0; o < yd.size (); ++o) {
+				ref[o].assign (yd[o].begin (), yd[o].end ());
+			}
+			const double snr = verify_snr (ref, y);
+
+			char name[32];
+			snprintf (name, sizeof (name), "%s/dual", v.name);
+			printf ("  %-19s %6u %9s %7u %8.1f %5s%s\n", name, ir_len,
+			        buffered ? "buffered" : "direct", dual_blocks[b], snr, "-",
+			        snr < 80 ? "  << FAIL" : "");
+
+			if (snr < 80) {
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+/* Gain and delay changes are applied to a running engine, see
+ * apply_ir_settings(). Once faded in, the output must be the same as
+ * that of an engine which was loaded with the new settings. A change that is neither the same
+ * for all paths of an output, nor for all paths of an input, needs a
+ * new engine.
+ */
+static bool
+verify_gain (uint32_t rate)
+{
+	struct GainChange {
+		const char* name;
+		float       gain;
+		float       channel_gain[4];
+		int32_t     pre_delay;
+		bool        live;
+	};
+
+	static const GainChange changes[] = {
+		{ "gain", .5f, { 1.f, 1.f, 1.f, 1.f }, 0, true },
+		{ "input L", 1.f, { .5f, .5f, 1.f, 1.f }, 0, true },
+		{ "output R", 1.f, { 1.f, .5f, 1.f, .5f }, 0, true },
+		{ "pre-delay", 1.f, { 1.f, 1.f, 1.f, 1.f }, 480, true },
+		{ "mute L->R", 1.f, { 1.f, 0.f, 1.f, 1.f }, 0, false },
+		{ "L->L", 1.f, { .5f, 1.f, 1.f, 1.f }, 0, false },
+	};
+
+	const VerifyCase v = { "truestereo", Convolver::Stereo, 2, 2, 4, false, false };
+
+	const uint32_t ir_len = 6000;
+	const uint32_t change = 8192;
+	/* the IR with the previous gain, and the gain interpolation */
+	const uint32_t settle = ir_len + rate / 10;
+	const uint32_t n      = change + settle + 8192;
+
+	std::vector<float> ir;
+	std::string        ir_path;
+	synthetic_ir (v.ir_chn, ir_len, ir);
+	if (!write_ir (ir, v.ir_chn, rate, ir_path)) {
+		fprintf (stderr, "Cannot write the synthetic IR\n");
+		return false;
+	}
+
+	uint32_t seed = 1;
+
+	std::vector<std::vector<float> > x (v.n_in, std::vector<float> (n));
+	for (uint32_t i = 0; i < v.n_in; ++i) {
+		for (uint32_t k = 0; k < n; ++k) {
+			x[i][k] = .1f * noise (seed);
+		}
+	}
+
+	printf ("# gain and delay changes of a running %s engine, IR %u\n", v.name, ir_len);
+
+	bool ok = true;
+	for (size_t c = 0; c < sizeof (changes) / sizeof (changes[0]); ++c) {
+		Convolver::IRSettings irs;
+		irs.gain      = changes[c].gain;
+		irs.pre_delay = changes[c].pre_delay;
+		memcpy (irs.channel_gain, changes[c].channel_gain, sizeof (irs.channel_gain));
+
+		Convolver* clv = NULL;
+		try {
+			clv = new Convolver (ir_path, rate, SCHED_OTHER, 0, v.irc, Convolver::IRSettings (), v.n_in, v.n_out);
+			clv->reconfigure (256);
+		} catch (std::exception const& e) {
+			fprintf (stderr, "Cannot load IR: %s\n", e.what ());
+		}
+		if (!clv || !clv->ready ()) {
+			fprintf (stderr, "Cannot configure convolver\n");
+			delete clv;
+			ok = false;
+			break;
+		}
+		clv->set_output_gain (0.f, 1.f, false);
+
+		const uint32_t lat = clv->latency ();
+
+		std::vector<std::vector<float> > y (v.n_out, std::vector<float> (n, 0.f));
+		std::vector<float>               l (100);
+		std::vector<float>               r (100);
+
+		bool live = false;
+		for (uint32_t pos = 0; pos < n + lat; pos += 100) {
+			if (pos <= change && change < pos + 100) {
+				live = clv->set_ir_settings (irs);
+			}
+			for (uint32_t k = 0; k < 100; ++k) {
+				l[k] = pos + k < n ? x[0][pos + k] : 0.f;
+				r[k] = pos + k < n ? x[1][pos + k] : 0.f;
+			}
+			clv->run_buffered_stereo (&l[0], &r[0], 100);
+			for (uint32_t k = 0; k < 100; ++k) {
+				if (pos + k >= lat && pos + k - lat < n) {
+					y[0][pos + k - lat] = l[k];
+					y[1][pos + k - lat] = r[k];
+				}
+			}
+		}
+		delete clv;
+
+		double snr = 0;
+		if (live) {
+			std::vector<std::vector<double> > ref;
+			verify_reference (v, irs, ir, ir_len, x, ref);
+			/* compare after the change has settled */
+			for (uint32_t o = 0; o < v.n_out; ++o) {
+				ref[o].erase (ref[o].begin (), ref[o].begin () + change + settle);
+				y[o].erase (y[o].begin (), y[o].begin () + change + settle);
+			}
+			snr = verify_snr (ref, y);
+		}
+
+		const bool pass = live == changes[c].live && (!live || snr >= 80);
+
+		printf ("  %-19s %9s", changes[c].name, live ? "live" : "new engine");
+		if (live) {
+			printf (" %8.1f dB", snr);
+		}
+		printf ("%s\n", pass ? "" : "  << FAIL");
+
+		if (!pass) {
+			ok = false;
+		}
+	}
+
+	unlink (ir_path.c_str ());
+	return ok;
+}
+
+/* Compare the output of run_mono(), run_stereo(), run_buffered_*() for
+ * all channel configs with a direct convolution, using block-sizes that
+ * are not a multiple of the engine's quantum. Each run is repeated with
+ * the background levels processed in the calling thread, which must give
+ * the same result. Summed inputs are also compared with the same signal
+ * on both inputs, see verify_dual(), and gain changes are applied to a
+ * running engine, see verify_gain().
+ */
+static int
+verify_report (uint32_t rate)
+{
+	static const uint32_t ir_lens[] = { 100, 6000 };
+
+	bool ok = true;
+
+	printf ("# run_*() vs. direct convolution at %u Hz, min. SNR: 80 dB\n", rate);
+	printf ("# %-19s %6s %9s %7s %8s %5s\n", "config", "IR", "mode", "blocks", "SNR[dB]", "sync");
+
+	for (size_t l = 0; l < sizeof (ir_lens) / sizeof (ir_lens[0]); ++l) {
+		const uint32_t ir_len = ir_lens[l];
+		const uint32_t n      = ir_len + 8192;
+
+		for (size_t c = 0; c < sizeof (verify_cases) / sizeof (verify_cases[0]); ++c) {
+			VerifyCase const& v = verify_cases[c];
+
+			std::vector<float> ir;
+			std::string        ir_path;
+			synthetic_ir (v.ir_chn, ir_len, ir);
+			if (!write_ir (ir, v.ir_chn, rate, ir_path)) {
+				fprintf (stderr, "Cannot write the synthetic IR\n");
+				return EXIT_FAILURE;
+			}
+
+			uint32_t seed = 1;
+
+			std::vector<std::vector<float> > x (v.n_in, std::vector<float> (n));
+			for (uint32_t i = 0; i < v.n_in; ++i) {
+				for (uint32_t k = 0; k < n; ++k) {
+					x[i][k] = .1f * noise (seed);
+				}
+			}
+			if (v.sum_inputs) {
+				/* the plugin sums in the realtime thread */
+				for (uint32_t k = 0; k < n; ++k) {
+					x[0][k] = .5f * (x[0][k] + x[1][k]);
+				}
+			}
+
+			std::vector<std::vector<double> > ref;
+			verify_reference (v, verify_settings (v), ir, ir_len, x, ref);
+
+			for (int mode = 0; mode < 2; ++mode) {
+				const bool buffered = mode == 0;
+				if (!buffered && v.irc == Convolver::Matrix) {
+					/* always buffered */
+					continue;
+				}
+				for (size_t b = 0; b < sizeof (verify_blocks) / sizeof (verify_blocks[0]); ++b) {
+					std::vector<std::vector<float> > y;
+					std::vector<std::vector<float> > y_sync;
+
+					if (!verify_run (v, ir_path, rate, buffered, false, verify_blocks[b], x, y)
+					    || !verify_run (v, ir_path, rate, buffered, true, verify_blocks[b], x, y_sync)) {
+						fprintf (stderr, "Cannot configure convolver\n");
+						unlink (ir_path.c_str ());
+						return EXIT_FAILURE;
+					}
+
+					const double snr  = verify_snr (ref, y);
+					const bool   same = y == y_sync;
+
+					char blocks[16];
+					if (verify_blocks[b] > 0) {
+						snprintf (blocks, sizeof (blocks), "%u", verify_blocks[b]);
+					} else {
+						snprintf (blocks, sizeof (blocks), "1..256");
+					}
+
+					printf ("  %-19s %6u %9s %7s %8.1f %5s%s\n", v.name, ir_len,
+					        buffered ? "buffered" : "direct", blocks, snr, same ? "same" : "DIFF",
+					        snr < 80 || !same ? "  << FAIL" : "");
+
+					if (snr < 80 || !same) {
+						ok = false;
+					}
+				}
+			}
+			if (v.sum_inputs && !verify_dual (v, ir_len, ir_path, rate, x)) {
+				ok = false;
+			}
+			unlink (ir_path.c_str ());
+		}
+	}
+	if (!verify_gain (rate)) {
+		ok = false;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void
+usage (int status)
+{
+	// clang-format off
+	printf ("zconvo-bench - measure the convolution engine.\n\n"
+	        "Usage: zconvo-bench [ OPTIONS ]\n\n"
+	        "Options:\n"
+	        "  -b, --block-size <n>  (max.) samples per period (default 256)\n"
+	        "  -C, --config <cfg>    channel config: mono, mono2stereo, stereo,\n"
+	        "                        truestereo or <in>x<out> (default: stereo)\n"
+	        "  -d, --duration <s>    processed audio in seconds (default 10)\n"
+	        "  -D, --direct          use the zero-latency run_mono/run_stereo\n"
+	        "                        instead of run_buffered_*\n"
+	        "  -F, --freewheel       do not pace periods in realtime\n"
+	        "  -h, --help            display this help and exit\n"
+	        "  -i, --ir <file>       IR file (default: synthetic IR)\n"
+	        "  -l, --length <n>      length of the synthetic IR in samples\n"
+	        "                        (default 96000)\n"
+	        "  -L, --lowrate-tail    convolve the tail at a lower rate (88.2kHz\n"
+	        "                        and above only)\n"
+	        "  -o, --output <file>   write the JSON report to the given file instead\n"
+	        "                        of stdout, which debug builds also print to\n"
+	        "  -P, --priority <n>    SCHED_FIFO priority, 0: SCHED_OTHER (default 0)\n"
+	        "  -r, --rate <n>        sample rate (default 48000)\n"
+	        "  -R, --random          use a random number of samples in\n"
+	        "                        1 .. block-size for each period\n"
+	        "  -s, --seed <n>        seed of the random block sizes (default 1)\n"
+	        "  -S, --sync            process all levels in this thread,\n"
+	        "                        as when the host is freewheeling\n"
+	        "\n");
+	// clang-format on
+	exit (status);
+}
+
+static struct option const long_options[] = {
+	{ "block-size", required_argument, 0, 'b' },
+	{ "config", required_argument, 0, 'C' },
+	{ "duration", required_argument, 0, 'd' },
+	{ "direct", no_argument, 0, 'D' },
+	{ "freewheel", no_argument, 0, 'F' },
+	{ "help", no_argument, 0, 'h' },
+	{ "ir", required_argument, 0, 'i' },
+	{ "length", required_argument, 0, 'l' },
+	{ "lowrate-tail", no_argument, 0, 'L' },
+	{ "output", required_argument, 0, 'o' },
+	{ "priority", required_argument, 0, 'P' },
+	{ "rate", required_argument, 0, 'r' },
+	{ "random", no_argument, 0, 'R' },
+	{ "seed", required_argument, 0, 's' },
+	{ "sync", no_argument, 0, 'S' },
+	{ "verify", no_argument, 0, 'V' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	Setup       s;
+	const char* report = NULL;
+	bool        verify = false;
+
+	s.irc           = Convolver::Stereo;
+	s.cfg_name      = "stereo";
+	s.n_in          = 2;
+	s.n_out         = 2;
+	s.ir_chn        = 2;
+	s.irlen         = 96000;
+	s.rate          = 48000;
+	s.block_size    = 256;
+	s.random_blocks = false;
+	s.buffered      = true;
+	s.lowrate_tail  = false;
+	s.freewheel     = false;
+	s.sync          = false;
+	s.duration      = 10;
+	s.priority      = 0;
+	s.seed          = 1;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "b:C:d:DFhi:l:Lo:P:r:Rs:SV", long_options, NULL)) != EOF) {
+		switch (c) {
+			case 'b':
+				s.block_size = atoi (optarg);
+				break;
+			case 'C':
+				s.cfg_name = optarg;
+				if (!strcmp (optarg, "mono")) {
+					s.irc  = Convolver::Mono;
+					s.n_in = s.n_out = s.ir_chn = 1;
+				} else if (!strcmp (optarg, "mono2stereo")) {
+					s.irc    = Convolver::MonoToStereo;
+					s.n_in   = 1;
+					s.n_out  = 2;
+					s.ir_chn = 2;
+				} else if (!strcmp (optarg, "stereo")) {
+					s.irc  = Convolver::Stereo;
+					s.n_in = s.n_out = s.ir_chn = 2;
+				} else if (!strcmp (optarg, "truestereo")) {
+					s.irc    = Convolver::Stereo;
+					s.n_in   = s.n_out = 2;
+					s.ir_chn = 4;
+				} else if (sscanf (optarg, "%ux%u", &s.n_in, &s.n_out) == 2
+				           && s.n_in > 0 && s.n_in <= Convolver::MAXCHN
+				           && s.n_out > 0 && s.n_out <= Convolver::MAXCHN) {
+					s.irc    = Convolver::Matrix;
+					s.ir_chn = s.n_in * s.n_out;
+				} else {
+					fprintf (stderr, "Invalid channel config '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 'd':
+				s.duration = atof (optarg);
+				break;
+			case 'D':
+				s.buffered = false;
+				break;
+			case 'F':
+				s.freewheel = true;
+				break;
+			case 'h':
+				usage (EXIT_SUCCESS);
+				break;
+			case 'i':
+				s.ir_file = optarg;
+				break;
+			case 'l':
+				s.irlen = atoi (optarg);
+				break;
+			case 'L':
+				s.lowrate_tail = true;
+				break;
+			case 'o':
+				report = optarg;
+				break;
+			case 'P':
+				s.priority = atoi (optarg);
+				break;
+			case 'r':
+				s.rate = atoi (optarg);
+				break;
+			case 'R':
+				s.random_blocks = true;
+				break;
+			case 's':
+				s.seed = atoi (optarg);
+				break;
+			case 'S':
+				s.sync = true;
+				break;
+			case 'V':
+				verify = true;
+				break;
+			default:
+				usage (EXIT_FAILURE);
+				break;
+		}
+	}
+
+	if (optind != argc) {
+		usage (EXIT_FAILURE);
+	}
+
+	if (s.block_size < 1 || s.block_size > 8192 || s.rate < 8000 || s.duration <= 0 || s.irlen < 1 || s.irlen > 0x4000000) {
+		fprintf (stderr, "Invalid parameter\n");
+		return EXIT_FAILURE;
+	}
+
+	if (verify) {
+		return verify_report (s.rate);
+	}
+
+	if (s.irc == Convolver::Matrix && !s.buffered) {
+		fprintf (stderr, "The matrix config is always buffered\n");
+		return EXIT_FAILURE;
+	}
+
+	if (s.priority > 0) {
+		struct sched_param parm;
+		parm.sched_priority = s.priority;
+		if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &parm)) {
+			fprintf (stderr, "Cannot use SCHED_FIFO, measurements will not be reliable\n");
+		}
+	}
+
+	std::string ir_path = s.ir_file;
+	if (ir_path.empty ()) {
+		std::vector<float> ir;
+		synthetic_ir (s.ir_chn, s.irlen, ir);
+		if (!write_ir (ir, s.ir_chn, s.rate, ir_path)) {
+			fprintf (stderr, "Cannot write the synthetic IR\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	Convolver::IRSettings irs;
+	irs.lowrate_tail = s.lowrate_tail;
+
+	Convolver* clv = NULL;
+	try {
+		clv = new Convolver (ir_path, s.rate, s.priority > 0 ? SCHED_FIFO : SCHED_OTHER, s.priority,
+		                     s.irc, irs, s.n_in, s.n_out);
+		clv->reconfigure (s.block_size);
+	} catch (std::exception const& e) {
+		fprintf (stderr, "Cannot load IR: %s\n", e.what ());
+	}
+
+	if (s.ir_file.empty ()) {
+		unlink (ir_path.c_str ());
+	}
+
+	if (!clv || !clv->ready ()) {
+		fprintf (stderr, "Cannot configure convolver\n");
+		delete clv;
+		return EXIT_FAILURE;
+	}
+
+	clv->set_freewheel (s.sync);
+
+	/* the engine processes buffers in-place */
+	const uint32_t n_buf = std::max (s.n_in, s.n_out);
+
+	std::vector<std::vector<float> > data (n_buf, std::vector<float> (s.block_size));
+	std::vector<float*>              buf (n_buf);
+	for (uint32_t i = 0; i < n_buf; ++i) {
+		buf[i] = &data[i][0];
+	}
+
+	const uint64_t n_total = s.duration * s.rate;
+
+	std::vector<double> dt;
+	dt.reserve (n_total / (s.random_blocks ? s.block_size / 2 + 1 : s.block_size) + 1);
+
+	uint32_t sig_seed = 1;
+	uint32_t blk_seed = s.seed;
+	uint64_t n_done   = 0;
+	uint32_t n_over   = 0;
+	int      n_thread = 0;
+
+	double deadline = now ();
+
+	while (n_done < n_total) {
+		uint32_t n_samples = s.block_size;
+		if (s.random_blocks) {
+			blk_seed  = blk_seed * 1664525 + 1013904223;
+			n_samples = 1 + (blk_seed >> 8) % s.block_size;
+		}
+
+		for (uint32_t i = 0; i < n_buf; ++i) {
+			for (uint32_t k = 0; k < n_samples; ++k) {
+				data[i][k] = i < s.n_in ? .1f * noise (sig_seed) : 0.f;
+			}
+		}
+
+		const double t0 = now ();
+		run (clv, s, &buf[0], n_samples);
+		const double t = now () - t0;
+
+		dt.push_back (t);
+		if (t > (double)n_samples / s.rate) {
+			++n_over;
+		}
+		n_done += n_samples;
+
+		if (dt.size () == 1) {
+			/* all level threads are running by now */
+			n_thread = count_threads ();
+		}
+
+		if (!s.freewheel) {
+			/* clock_nanosleep() is not available on macOS */
+			deadline += (double)n_samples / s.rate;
+			const double remain = deadline - now ();
+			if (remain > 0) {
+				struct timespec ts;
+				ts.tv_sec  = remain;
+				ts.tv_nsec = 1e9 * (remain - ts.tv_sec);
+				nanosleep (&ts, NULL);
+			}
+		}
+	}
+
+	size_t   bytes, locked;
+	uint32_t count;
+	clv->memory_stats (bytes, locked, count);
+
+	Convproc::SkipStats skip;
+	clv->skip_stats (skip);
+
+	const uint32_t latency = clv->latency ();
+	const uint32_t n_late  = clv->late_cycles ();
+	const uint32_t ir_len  = clv->ir_length ();
+
+	delete clv;
+
+	double mean = 0;
+	for (std::vector<double>::const_iterator i = dt.begin (); i != dt.end (); ++i) {
+		mean += *i;
+	}
+	mean /= dt.size ();
+
+	std::sort (dt.begin (), dt.end ());
+	const double p99  = dt[std::min (dt.size () - 1, (size_t)ceil (.99 * dt.size ()) - 1)];
+	const double tmax = dt.back ();
+
+	FILE* f = report ? fopen (report, "w") : stdout;
+	if (!f) {
+		fprintf (stderr, "Cannot open '%s' for writing\n", report);
+		return EXIT_FAILURE;
+	}
+
+	fprintf (f, "{\n");
+	fprintf (f, "  \"config\": {\n");
+	fprintf (f, "    \"channels\": %s,\n", json_string (s.cfg_name).c_str ());
+	fprintf (f, "    \"inputs\": %u,\n", s.n_in);
+	fprintf (f, "    \"outputs\": %u,\n", s.n_out);
+	fprintf (f, "    \"ir\": %s,\n", s.ir_file.empty () ? "null" : json_string (s.ir_file).c_str ());
+	fprintf (f, "    \"ir_length\": %u,\n", ir_len);
+	fprintf (f, "    \"rate\": %u,\n", s.rate);
+	fprintf (f, "    \"block_size\": %u,\n", s.block_size);
+	fprintf (f, "    \"random_blocks\": %s,\n", s.random_blocks ? "true" : "false");
+	fprintf (f, "    \"buffered\": %s,\n", s.buffered ? "true" : "false");
+	fprintf (f, "    \"lowrate_tail\": %s,\n", s.lowrate_tail ? "true" : "false");
+	fprintf (f, "    \"freewheel\": %s,\n", s.freewheel ? "true" : "false");
+	fprintf (f, "    \"sync\": %s,\n", s.sync ? "true" : "false");
+	fprintf (f, "    \"priority\": %d\n", s.priority);
+	fprintf (f, "  },\n");
+	fprintf (f, "  \"latency\": %u,\n", s.buffered ? latency : 0);
+	fprintf (f, "  \"periods\": %zu,\n", dt.size ());
+	fprintf (f, "  \"samples\": %llu,\n", (unsigned long long)n_done);
+	fprintf (f, "  \"period_us\": {\n");
+	fprintf (f, "    \"mean\": %.2f,\n", 1e6 * mean);
+	fprintf (f, "    \"p99\": %.2f,\n", 1e6 * p99);
+	fprintf (f, "    \"max\": %.2f\n", 1e6 * tmax);
+	fprintf (f, "  },\n");
+	fprintf (f, "  \"dsp_load\": %.4f,\n", mean * dt.size () * s.rate / n_done);
+	fprintf (f, "  \"overruns\": %u,\n", n_over);
+	fprintf (f, "  \"late_cycles\": %u,\n", n_late);
+	fprintf (f, "  \"threads\": %d,\n", n_thread);
+	fprintf (f, "  \"engine_bytes\": %zu,\n", bytes);
+	fprintf (f, "  \"locked_bytes\": %zu,\n", locked);
+	fprintf (f, "  \"skipped\": {\n");
+	fprintf (f, "    \"silence_dbfs\": %.0f,\n", 10 * log10f (Convolver::SILENCE_POWER));
+	fprintf (f, "    \"sparse_db\": %.0f,\n", 10 * log10f (Convolver::SPARSE_ERROR));
+	fprintf (f, "    \"fft\": %.4f,\n", skip.nfft > 0 ? (double)skip.sfft / skip.nfft : 0);
+	fprintf (f, "    \"mac\": %.4f,\n", skip.nmac > 0 ? (double)skip.smac / skip.nmac : 0);
+	fprintf (f, "    \"bins\": %.4f\n", skip.nbins > 0 ? (double)skip.sbins / skip.nbins : 0);
+	fprintf (f, "  },\n");
+	fprintf (f, "  \"max_rss_kib\": %ld\n", max_rss_kib ());
+	fprintf (f, "}\n");
+
+	if (f != stdout) {
+		fclose (f);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,991 @@
+/* zconvo-tune -- measure Convproc partition layouts
+ *
+ * Copyright (C) 2022 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Enumerate candidate partition layouts (minpart, maxpart, density)
+ * for a given IR length, channel configuration, quantum and core count.
+ * Every layout is run with synthetic input, and CPU time per period as
+ * well as the worst-case completion time of each level are measured.
+ *
+ * The best zero-latency layout is printed as (or appended to) a table
+ * that the plugin consults when configuring the convolver.
+ * See lookup_layout() in src/convolver.cc
+ *
+ * Alternatively (--sparse) the CPU time and accuracy of the sparse
+ * spectral MAC are compared to the dense kernel for various error bounds.
+ *
+ * Or (--maxpart) the FFT/MAC cost ratio of large partitions is compared
+ * with the model used by the convolver, and the CPU time of the default
+ * layout is compared for tail partitions limited to 8192 samples and
+ * larger ones.
+ *
+ * Or (--verify) the output of the engine without threads is compared
+ * against a direct convolution, for various IR lengths and layouts,
+ * and for a sparse IR longer than 2^24 samples.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#ifndef WITH_LEVEL_STATS
+#error "zconvo-tune must be compiled with -DWITH_LEVEL_STATS"
+#endif
+
+#include <fftw3.h>
+
+#include "../src/zeta-convolver.h"
+
+struct Setup {
+	uint32_t ninp;
+	uint32_t nout;
+	uint32_t npaths;
+	uint32_t quantum;
+	uint32_t irlen;
+	uint32_t ncores;
+	uint32_t rate;
+	double   duration;
+	bool     freewheel;
+	bool     all_minpart;
+	bool     sparse_report;
+	bool     maxpart_report;
+	bool     verify;
+	int      priority;
+};
+
+struct Result {
+	uint32_t minpart;
+	uint32_t maxpart;
+	float    density;
+	float    sparse;
+	uint32_t nlevels;
+	uint32_t nlate;
+	double   cpu;      // mean CPU time per period [sec]
+	double   t_period; // worst-case process() call [sec]
+	double   load;     // worst-case level completion / level deadline
+	bool     ok;
+};
+
+static double
+now (clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime (clk, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static float
+noise (uint32_t& seed)
+{
+	seed = seed * 1664525 + 1013904223;
+	return (seed >> 8) / 8388608.f - 1.f;
+}
+
+static void
+map_path (Setup const& s, uint32_t c, uint32_t& inp, uint32_t& out)
+{
+	if (s.npaths == s.ninp * s.nout) {
+		inp = (c / s.nout) % s.ninp;
+	} else {
+		inp = c % s.ninp;
+	}
+	out = c % s.nout;
+}
+
+static bool
+load_ir (Setup const& s, std::vector<float> const& ir, Result const& r, Convproc& cp)
+{
+	cp.set_sparse_threshold (r.sparse);
+
+	if (cp.configure (s.ninp, s.nout, s.irlen, s.quantum, r.minpart, r.maxpart, r.density)) {
+		return false;
+	}
+
+	for (uint32_t c = 0; c < s.npaths; ++c) {
+		uint32_t inp, out;
+		map_path (s, c, inp, out);
+		/* use a different part of the noise for each path */
+		float* data = const_cast<float*> (&ir[(c * 997) % (ir.size () - s.irlen)]);
+		if (cp.impdata_create (inp, out, 1, data, 0, s.irlen)) {
+			cp.cleanup ();
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+run_layout (Setup const& s, std::vector<float> const& ir, Result& r, std::vector<float>* rec = NULL)
+{
+	Convproc cp;
+
+	r.nlevels = 0;
+	r.nlate   = 0;
+	r.cpu     = 0;
+	r.load    = 0;
+	r.ok      = false;
+
+	if (!load_ir (s, ir, r, cp)) {
+		return false;
+	}
+
+	const double period = (double)s.quantum / s.rate;
+	const int    policy = s.priority > 0 ? SCHED_FIFO : SCHED_OTHER;
+
+	if (cp.start_process (s.priority, policy, 1e9 * period)) {
+		cp.cleanup ();
+		return false;
+	}
+
+	r.nlevels = cp.nlevels ();
+
+	/* warm up: let every level complete a few cycles */
+	uint32_t parsize, npar;
+	double   t_max;
+	cp.level_stats (r.nlevels - 1, parsize, npar, t_max);
+
+	const uint32_t n_warmup  = 4 * parsize / s.quantum;
+	const uint32_t n_periods = ceil (s.duration / period);
+
+	uint32_t seed = 1;
+	double   t_cpu = 0;
+
+	struct timespec deadline;
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+	for (uint32_t n = 0; n < n_warmup + n_periods; ++n) {
+		if (n == n_warmup) {
+			cp.reset_stats ();
+			r.t_period = 0;
+			t_cpu      = now (CLOCK_PROCESS_CPUTIME_ID);
+		}
+
+		for (uint32_t i = 0; i < s.ninp; ++i) {
+			float* in = cp.inpdata (i);
+			for (uint32_t k = 0; k < s.quantum; ++k) {
+				in[k] = .1f * noise (seed);
+			}
+		}
+
+		const double t0 = now (CLOCK_MONOTONIC);
+		if (cp.process () & Convproc::FL_LATE) {
+			if (n >= n_warmup) {
+				++r.nlate;
+			}
+		}
+		const double dt = now (CLOCK_MONOTONIC) - t0;
+		if (dt > r.t_period) {
+			r.t_period = dt;
+		}
+
+		if (rec && n >= n_warmup) {
+			for (uint32_t o = 0; o < s.nout; ++o) {
+				rec->insert (rec->end (), cp.outdata (o), cp.outdata (o) + s.quantum);
+			}
+		}
+
+		if (cp.state () != Convproc::ST_PROC) {
+			/* too many late cycles, Convproc gave up */
+			r.nlate += n_periods;
+			break;
+		}
+
+		if (!s.freewheel) {
+			deadline.tv_nsec += 1e9 * period;
+			while (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_nsec -= 1000000000;
+				++deadline.tv_sec;
+			}
+			clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		}
+	}
+
+	r.cpu = (now (CLOCK_PROCESS_CPUTIME_ID) - t_cpu) / n_periods;
+
+	for (uint32_t l = 0; l < r.nlevels; ++l) {
+		cp.level_stats (l, parsize, npar, t_max);
+		const double load = t_max * s.rate / parsize;
+		if (load > r.load) {
+			r.load = load;
+		}
+	}
+
+	cp.stop_process ();
+	cp.cleanup ();
+
+	/* Late levels block process() */
+	r.ok = r.nlate == 0 && r.load < 1.0 && (s.freewheel || r.t_period < period);
+	return true;
+}
+
+static double
+snr (std::vector<float> const& ref, std::vector<float> const& out)
+{
+	double sig = 0;
+	double err = 0;
+	for (size_t i = 0; i < ref.size () && i < out.size (); ++i) {
+		sig += ref[i] * ref[i];
+		err += (ref[i] - out[i]) * (ref[i] - out[i]);
+	}
+	return err > 0 ? 10 * log10 (sig / err) : INFINITY;
+}
+
+/* process n_periods of noise with all levels in this thread,
+ * out holds the output of all outputs, interleaved by period */
+static bool
+run_sync (Setup const& s, std::vector<float> const& ir, Result& r, uint32_t n_periods, std::vector<float>& out)
+{
+	Convproc cp;
+
+	cp.set_options (Convproc::OPT_NO_THREADS);
+	if (!load_ir (s, ir, r, cp) || cp.start_process (0, SCHED_OTHER, 0)) {
+		cp.cleanup ();
+		return false;
+	}
+	r.nlevels = cp.nlevels ();
+
+	uint32_t seed = 1;
+	out.clear ();
+	for (uint32_t n = 0; n < n_periods; ++n) {
+		for (uint32_t i = 0; i < s.ninp; ++i) {
+			float* in = cp.inpdata (i);
+			for (uint32_t k = 0; k < s.quantum; ++k) {
+				in[k] = .1f * noise (seed);
+			}
+		}
+		cp.process ();
+		for (uint32_t o = 0; o < s.nout; ++o) {
+			out.insert (out.end (), cp.outdata (o), cp.outdata (o) + s.quantum);
+		}
+	}
+
+	cp.stop_process ();
+	cp.cleanup ();
+	return true;
+}
+
+/* direct convolution of the same input and paths as run_sync () */
+static void
+convolve (Setup const& s, std::vector<float> const& ir, uint32_t n_periods, std::vector<float>& ref)
+{
+	const uint32_t n_samples = n_periods * s.quantum;
+
+	std::vector<std::vector<float> > x (s.ninp, std::vector<float> (n_samples));
+	std::vector<std::vector<double> > y (s.nout, std::vector<double> (n_samples, 0.0));
+
+	uint32_t seed = 1;
+	for (uint32_t n = 0; n < n_periods; ++n) {
+		for (uint32_t i = 0; i < s.ninp; ++i) {
+			for (uint32_t k = 0; k < s.quantum; ++k) {
+				x[i][n * s.quantum + k] = .1f * noise (seed);
+			}
+		}
+	}
+
+	for (uint32_t c = 0; c < s.npaths; ++c) {
+		uint32_t inp, out;
+		map_path (s, c, inp, out);
+		float const* h = &ir[(c * 997) % (ir.size () - s.irlen)];
+		for (uint32_t t = 0; t < n_samples; ++t) {
+			double         acc = 0;
+			const uint32_t len = std::min (s.irlen, t + 1);
+			for (uint32_t k = 0; k < len; ++k) {
+				acc += (double)h[k] * x[inp][t - k];
+			}
+			y[out][t] += acc;
+		}
+	}
+
+	ref.clear ();
+	for (uint32_t n = 0; n < n_periods; ++n) {
+		for (uint32_t o = 0; o < s.nout; ++o) {
+			for (uint32_t k = 0; k < s.quantum; ++k) {
+				ref.push_back (y[o][n * s.quantum + k]);
+			}
+		}
+	}
+}
+
+/* An IR longer than 2^24 samples, with the largest partitions.
+ *
+ * A dense IR of this length can not be verified by direct convolution
+ * in reasonable time. The IR is therefore sparse: short noise segments
+ * at the start, in the middle, past 2^24 and at the very end, and the
+ * input is a noise burst followed by silence. The reference output is
+ * the sum of the convolution of the burst with each segment.
+ */
+static const uint32_t long_irlen = (1 << 24) + 65536 + 77;
+
+struct LongSegment {
+	uint32_t           offs;
+	std::vector<float> h;
+};
+
+static bool
+verify_long (uint32_t quantum, Result& r, double& snr_db, uint64_t& hash)
+{
+	const uint32_t irlen   = long_irlen;
+	const uint32_t seglen  = 300;
+	const uint32_t burst   = 4096;
+	const uint32_t start[] = { 0, (1 << 23) + 12345, (1 << 24) + 1000, irlen - seglen };
+
+	std::vector<LongSegment> seg (sizeof (start) / sizeof (uint32_t));
+	std::vector<float>       x (burst);
+
+	uint32_t seed = 1;
+	for (size_t i = 0; i < seg.size (); ++i) {
+		seg[i].offs = start[i];
+		seg[i].h.resize (seglen);
+		for (uint32_t k = 0; k < seglen; ++k) {
+			seg[i].h[k] = .5f * noise (seed);
+		}
+	}
+	for (uint32_t k = 0; k < burst; ++k) {
+		x[k] = .1f * noise (seed);
+	}
+
+	Convproc cp;
+	cp.set_options (Convproc::OPT_NO_THREADS);
+	r.minpart = quantum;
+	r.maxpart = Convproc::MAXPART;
+	if (cp.configure (1, 1, irlen, quantum, r.minpart, r.maxpart, 0)) {
+		return false;
+	}
+	for (size_t i = 0; i < seg.size (); ++i) {
+		if (cp.impdata_create (0, 0, 1, &seg[i].h[0], seg[i].offs, seg[i].offs + seglen)) {
+			cp.cleanup ();
+			return false;
+		}
+	}
+	if (cp.start_process (0, SCHED_OTHER, 0)) {
+		cp.cleanup ();
+		return false;
+	}
+
+	/* the size of the largest partition, as configured */
+	uint32_t npar;
+	double   t_max;
+	r.nlevels = cp.nlevels ();
+	cp.level_stats (r.nlevels - 1, r.maxpart, npar, t_max);
+
+	const uint32_t n_periods = (irlen + burst) / quantum + 1;
+
+	double sig = 0;
+	double err = 0;
+	hash       = 14695981039346656037ULL; // FNV-1a
+
+	for (uint32_t n = 0; n < n_periods; ++n) {
+		float* in = cp.inpdata (0);
+		for (uint32_t k = 0; k < quantum; ++k) {
+			const uint32_t t = n * quantum + k;
+			in[k]            = t < burst ? x[t] : 0.f;
+		}
+		cp.process ();
+		float const* out = cp.outdata (0);
+		for (uint32_t k = 0; k < quantum; ++k) {
+			const uint32_t t   = n * quantum + k;
+			double         ref = 0;
+			for (size_t i = 0; i < seg.size (); ++i) {
+				if (t < seg[i].offs || t >= seg[i].offs + seglen + burst) {
+					continue;
+				}
+				const uint32_t d = t - seg[i].offs;
+				for (uint32_t j = d < burst ? 0 : d - burst + 1; j < seglen && j <= d; ++j) {
+					ref += (double)seg[i].h[j] * x[d - j];
+				}
+			}
+			sig += ref * ref;
+			err += (ref - out[k]) * (ref - out[k]);
+
+			uint32_t bits;
+			memcpy (&bits, &out[k], sizeof (bits));
+			hash = (hash ^ bits) * 1099511628211ULL;
+		}
+	}
+
+	cp.stop_process ();
+	cp.cleanup ();
+
+	snr_db = err > 0 ? 10 * log10 (sig / err) : INFINITY;
+	return true;
+}
+
+/* Compare the engine without threads against a direct convolution,
+ * for IR lengths up to the given one, zero-latency layouts with
+ * uniform and non-uniform partitions, and several quanta. Every
+ * case is run twice, the output must be identical. */
+static int
+verify_report (Setup const& s, std::vector<float> const& ir)
+{
+	const uint32_t lengths[] = { 1, 63, 64, 65, 1000, 4097, 12345, 32768 };
+	const uint32_t quanta[]  = { 64, 128, 1024 };
+	const double   min_snr   = 80; // single vs double precision
+
+	bool ok = true;
+
+	printf ("# %d in, %d out, %d paths\n", s.ninp, s.nout, s.npaths);
+	printf ("#   irlen quantum maxpart levels snr[dB] repeat\n");
+
+	for (size_t l = 0; l < sizeof (lengths) / sizeof (uint32_t); ++l) {
+		if (lengths[l] > s.irlen) {
+			break;
+		}
+		for (size_t q = 0; q < sizeof (quanta) / sizeof (uint32_t); ++q) {
+			Setup h   = s;
+			h.irlen   = lengths[l];
+			h.quantum = quanta[q];
+
+			/* all partitions contribute to the end of the output */
+			const uint32_t n_periods = (h.irlen + 4096) / h.quantum + 1;
+
+			std::vector<float> ref;
+			convolve (h, ir, n_periods, ref);
+
+			/* uniform and non-uniform partitions */
+			const uint32_t maxparts[] = { h.quantum, Convproc::MAXPART };
+
+			for (size_t m = 0; m < sizeof (maxparts) / sizeof (uint32_t); ++m) {
+				std::vector<float> out, rep;
+				Result             r;
+				r.minpart = h.quantum;
+				r.maxpart = maxparts[m];
+				r.density = 0;
+				r.sparse  = 0;
+
+				if (!run_sync (h, ir, r, n_periods, out) || !run_sync (h, ir, r, n_periods, rep)) {
+					fprintf (stderr, "Cannot configure convolver\n");
+					return EXIT_FAILURE;
+				}
+
+				const double d    = snr (ref, out);
+				const bool   same = out == rep;
+				ok                = ok && same && d >= min_snr;
+
+				printf ("  %7d %7d %7d %6d %7.1f %6s%s\n",
+				        h.irlen, h.quantum, maxparts[m], r.nlevels, d,
+				        same ? "same" : "differ", same && d >= min_snr ? "" : " (x)");
+				fflush (stdout);
+			}
+		}
+	}
+
+	/* a sparse mono IR longer than 2^24 samples, with MAXPART tail
+	 * partitions and up to MAXLEV levels, see verify_long () */
+	printf ("# 1 in, 1 out, sparse IR\n");
+	printf ("#    irlen quantum maxpart levels snr[dB] repeat\n");
+
+	for (size_t q = 0; q < sizeof (quanta) / sizeof (uint32_t); ++q) {
+		Result   r;
+		double   d;
+		uint64_t hash, hrep;
+		if (!verify_long (quanta[q], r, d, hash) || !verify_long (quanta[q], r, d, hrep)) {
+			fprintf (stderr, "Cannot configure convolver\n");
+			return EXIT_FAILURE;
+		}
+		const bool same  = hash == hrep;
+		const bool limit = r.maxpart == Convproc::MAXPART && r.nlevels <= Convproc::MAXLEV;
+		ok               = ok && same && limit && d >= min_snr;
+
+		printf ("  %8d %7d %7d %6d %7.1f %6s%s\n",
+		        long_irlen, quanta[q], r.maxpart, r.nlevels, d,
+		        same ? "same" : "differ", same && limit && d >= min_snr ? "" : " (x)");
+		fflush (stdout);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* compare sparse MAC against the dense kernel using the default layout */
+static int
+sparse_report (Setup const& s, std::vector<float> const& ir)
+{
+	const float errs[] = { 0.f, 1e-10f, 1e-9f, 1e-8f, 1e-7f, 1e-6f, 1e-5f, 1e-4f };
+
+	std::vector<float> ref;
+	double             cpu_dense = 0;
+
+	printf ("# IR: %d samples, %d in, %d out, %d paths, quantum %d @ %dHz\n",
+	        s.irlen, s.ninp, s.nout, s.npaths, s.quantum, s.rate);
+	printf ("# error-bound[dB]  cpu[us] speedup snr[dB]\n");
+
+	for (size_t e = 0; e < sizeof (errs) / sizeof (float); ++e) {
+		std::vector<float> out;
+		Result             r;
+		r.minpart = s.quantum < Convproc::MINPART ? Convproc::MINPART : s.quantum;
+		r.maxpart = Convproc::MAXPART;
+		r.density = 0;
+		r.sparse  = errs[e];
+
+		if (!run_layout (s, ir, r, e == 0 ? &ref : &out)) {
+			fprintf (stderr, "Cannot configure convolver\n");
+			return EXIT_FAILURE;
+		}
+
+		if (e == 0) {
+			cpu_dense = r.cpu;
+			printf ("  %16s %8.1f %7.2f %7s%s\n", "dense", 1e6 * r.cpu, 1.0, "-", r.ok ? "" : " (x)");
+			continue;
+		}
+
+		double sig = 0;
+		double err = 0;
+		for (size_t i = 0; i < ref.size () && i < out.size (); ++i) {
+			sig += ref[i] * ref[i];
+			err += (ref[i] - out[i]) * (ref[i] - out[i]);
+		}
+
+		printf ("  %16.0f %8.1f %7.2f %7.1f%s\n",
+		        10 * log10f (errs[e]), 1e6 * r.cpu, cpu_dense / r.cpu,
+		        err > 0 ? 10 * log10 (sig / err) : INFINITY,
+		        r.ok ? "" : " (x)");
+		fflush (stdout);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* compare the default layout with tail partitions limited to 8192
+ * samples (the former MAXPART) against larger tail partitions.
+ *
+ * All levels are processed in process(), without background threads,
+ * for a whole number of cycles of the largest partition. The CPU time
+ * per period is hence the complete work, independent of scheduling.
+ */
+/* Measure the FFT cost per sample (input r2c and output c2r of a
+ * partition) relative to the MAC cost per bin, for partition sizes
+ * from Convproc::FFTCOST_KNEE to MAXPART. The ratio normalized to the
+ * knee is what Convproc::fftcost_scale() models.
+ */
+static void
+fftcost_report ()
+{
+	printf ("# parsize fft/mac measured  model\n");
+
+	float ratio_knee = 0;
+	for (uint32_t size = Convproc::FFTCOST_KNEE; size <= Convproc::MAXPART; size *= 2) {
+		const uint32_t n_fft = 2 * size;
+		const uint32_t n_bin = size + 1;
+		const uint32_t n_mac = 8; /* partitions per MAC pass */
+		const uint32_t n_itr = std::max<uint32_t> (4, (1 << 25) / n_fft);
+
+		float*         td = (float*)fftwf_malloc (n_fft * sizeof (float));
+		fftwf_complex* fd = (fftwf_complex*)fftwf_malloc (n_bin * sizeof (fftwf_complex));
+		fftwf_complex* xx = (fftwf_complex*)fftwf_malloc (n_mac * n_bin * sizeof (fftwf_complex));
+		fftwf_complex* hh = (fftwf_complex*)fftwf_malloc (n_mac * n_bin * sizeof (fftwf_complex));
+
+		fftwf_plan fwd = fftwf_plan_dft_r2c_1d (n_fft, td, fd, FFTW_ESTIMATE);
+		fftwf_plan rev = fftwf_plan_dft_c2r_1d (n_fft, fd, td, FFTW_ESTIMATE);
+
+		uint32_t seed = 1;
+		for (uint32_t k = 0; k < n_fft; ++k) {
+			td[k] = k < size ? noise (seed) : 0.f;
+		}
+		for (uint32_t k = 0; k < n_mac * n_bin; ++k) {
+			xx[k][0] = hh[k][1] = 1e-3f * noise (seed);
+			xx[k][1] = hh[k][0] = 1e-3f * noise (seed);
+		}
+
+		/* best of 5, to skip interrupts and frequency scaling */
+		double t_fft = 1e9;
+		double t_mac = 1e9;
+		for (int r = 0; r < 5; ++r) {
+			double t0 = now (CLOCK_MONOTONIC);
+			for (uint32_t i = 0; i < n_itr; ++i) {
+				fftwf_execute (fwd);
+				fftwf_execute (rev);
+			}
+			t_fft = std::min (t_fft, (now (CLOCK_MONOTONIC) - t0) / n_itr / size);
+
+			t0 = now (CLOCK_MONOTONIC);
+			for (uint32_t i = 0; i < n_itr; ++i) {
+				for (uint32_t p = 0; p < n_mac; ++p) {
+					fftwf_complex const* X = xx + p * n_bin;
+					fftwf_complex const* H = hh + p * n_bin;
+					for (uint32_t k = 0; k < n_bin; ++k) {
+						fd[k][0] += X[k][0] * H[k][0] - X[k][1] * H[k][1];
+						fd[k][1] += X[k][0] * H[k][1] + X[k][1] * H[k][0];
+					}
+				}
+			}
+			t_mac = std::min (t_mac, (now (CLOCK_MONOTONIC) - t0) / n_itr / n_mac / size);
+		}
+
+		fftwf_destroy_plan (fwd);
+		fftwf_destroy_plan (rev);
+		fftwf_free (td);
+		fftwf_free (fd);
+		fftwf_free (xx);
+		fftwf_free (hh);
+
+		const float ratio = t_fft / t_mac;
+		if (size == Convproc::FFTCOST_KNEE) {
+			ratio_knee = ratio;
+		}
+		printf ("  %7d %7.2f %8.2f %6.2f\n",
+		        size, ratio, ratio / ratio_knee, Convproc::fftcost_scale (size));
+		fflush (stdout);
+	}
+}
+
+static int
+maxpart_report (Setup const& s, std::vector<float> const& ir)
+{
+	fftcost_report ();
+
+	const uint32_t n_cycle   = Convproc::MAXPART / s.quantum;
+	const uint32_t n_periods = n_cycle * ceil (s.duration * s.rate / Convproc::MAXPART);
+
+	printf ("# IR: %d samples, %d in, %d out, %d paths, quantum %d @ %dHz, %d periods\n",
+	        s.irlen, s.ninp, s.nout, s.npaths, s.quantum, s.rate, n_periods);
+	printf ("# maxpart levels  cpu[us] dsp[%%] speedup\n");
+
+	double cpu_8k = 0;
+	for (uint32_t maxpart = 8192; maxpart <= Convproc::MAXPART; maxpart *= 2) {
+		Result   r;
+		Convproc cp;
+		r.minpart = s.quantum < Convproc::MINPART ? Convproc::MINPART : s.quantum;
+		r.maxpart = maxpart;
+		r.density = 0;
+		r.sparse  = 0;
+		cp.set_options (Convproc::OPT_NO_THREADS);
+		if (!load_ir (s, ir, r, cp) || cp.start_process (0, SCHED_OTHER, 0)) {
+			fprintf (stderr, "Cannot configure convolver\n");
+			cp.cleanup ();
+			return EXIT_FAILURE;
+		}
+		r.nlevels = cp.nlevels ();
+
+		/* one cycle to warm up, then measure */
+		uint32_t seed  = 1;
+		double   t_cpu = 0;
+		for (uint32_t n = 0; n < n_cycle + n_periods; ++n) {
+			if (n == n_cycle) {
+				t_cpu = now (CLOCK_PROCESS_CPUTIME_ID);
+			}
+			for (uint32_t i = 0; i < s.ninp; ++i) {
+				float* in = cp.inpdata (i);
+				for (uint32_t k = 0; k < s.quantum; ++k) {
+					in[k] = .1f * noise (seed);
+				}
+			}
+			cp.process ();
+		}
+		r.cpu = (now (CLOCK_PROCESS_CPUTIME_ID) - t_cpu) / n_periods;
+
+		cp.stop_process ();
+		cp.cleanup ();
+
+		if (maxpart == 8192) {
+			cpu_8k = r.cpu;
+		}
+		printf ("  %7d %6d %8.1f %6.1f %7.2f\n",
+		        r.maxpart, r.nlevels, 1e6 * r.cpu, 100 * r.cpu * s.rate / s.quantum, cpu_8k / r.cpu);
+		fflush (stdout);
+		if (maxpart >= s.irlen) {
+			/* larger partitions will not change the layout */
+			break;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static void
+usage (int status)
+{
+	// clang-format off
+	printf ("zconvo-tune - measure convolver partition layouts.\n\n"
+	        "Usage: zconvo-tune [ OPTIONS ] <IR length>\n\n"
+	        "The IR length is given in samples.\n\n"
+	        "Options:\n"
+	        "  -a, --all-minpart   also measure layouts with minpart > quantum\n"
+	        "                      (these add latency and are never used by the plugin)\n"
+	        "  -c, --cores <num>   restrict to the first <num> CPU cores\n"
+	        "  -C, --config <cfg>  channel config: mono, mono2stereo, stereo, truestereo\n"
+	        "                      (default: stereo)\n"
+	        "  -d, --duration <s>  measurement time per layout in seconds (default 2)\n"
+	        "  -F, --freewheel     do not pace periods in realtime\n"
+	        "  -h, --help          display this help and exit\n"
+	        "  -m, --maxpart       compare the CPU time with tail partitions of\n"
+	        "                      8192 samples and larger, instead of measuring layouts\n"
+	        "  -P, --priority <n>  SCHED_FIFO priority, 0: SCHED_OTHER (default 0)\n"
+	        "  -q, --quantum <n>   processing block size (default 64)\n"
+	        "  -r, --rate <n>      sample rate (default 48000)\n"
+	        "  -s, --sparse        compare the sparse MAC error bounds against the\n"
+	        "                      dense kernel, instead of measuring layouts\n"
+	        "  -V, --verify        compare the output without threads against a\n"
+	        "                      direct convolution, for IR lengths up to <IR length>\n"
+	        "  -w, --write <file>  append the best layout to the given table\n"
+	        "\n"
+	        "Table rows are:\n"
+	        "  ninp nout npaths quantum irlen ncores minpart maxpart density\n"
+	        "The plugin reads the table from $ZCONVOLV_LAYOUT or\n"
+	        "$XDG_CONFIG_HOME/zconvolv/layout.conf\n"
+	        "\n");
+	// clang-format on
+	exit (status);
+}
+
+static struct option const long_options[] = {
+	{ "all-minpart", no_argument, 0, 'a' },
+	{ "cores", required_argument, 0, 'c' },
+	{ "config", required_argument, 0, 'C' },
+	{ "duration", required_argument, 0, 'd' },
+	{ "freewheel", no_argument, 0, 'F' },
+	{ "help", no_argument, 0, 'h' },
+	{ "maxpart", no_argument, 0, 'm' },
+	{ "priority", required_argument, 0, 'P' },
+	{ "quantum", required_argument, 0, 'q' },
+	{ "rate", required_argument, 0, 'r' },
+	{ "sparse", no_argument, 0, 's' },
+	{ "verify", no_argument, 0, 'V' },
+	{ "write", required_argument, 0, 'w' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	Setup       s;
+	const char* table = NULL;
+
+	s.ninp        = 2;
+	s.nout        = 2;
+	s.npaths      = 2;
+	s.quantum     = 64;
+	s.ncores      = sysconf (_SC_NPROCESSORS_ONLN);
+	s.rate        = 48000;
+	s.duration    = 2;
+	s.freewheel   = false;
+	s.all_minpart   = false;
+	s.sparse_report  = false;
+	s.maxpart_report = false;
+	s.verify         = false;
+	s.priority      = 0;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "ac:C:d:FhmP:q:r:sVw:", long_options, NULL)) != EOF) {
+		switch (c) {
+			case 'a':
+				s.all_minpart = true;
+				break;
+			case 'c':
+				s.ncores = atoi (optarg);
+				break;
+			case 'C':
+				if (!strcmp (optarg, "mono")) {
+					s.ninp = s.nout = s.npaths = 1;
+				} else if (!strcmp (optarg, "mono2stereo")) {
+					s.ninp   = 1;
+					s.nout   = 2;
+					s.npaths = 2;
+				} else if (!strcmp (optarg, "stereo")) {
+					s.ninp = s.nout = s.npaths = 2;
+				} else if (!strcmp (optarg, "truestereo")) {
+					s.ninp = s.nout = 2;
+					s.npaths        = 4;
+				} else {
+					fprintf (stderr, "Invalid channel config '%s'\n", optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 'd':
+				s.duration = atof (optarg);
+				break;
+			case 'F':
+				s.freewheel = true;
+				break;
+			case 'h':
+				usage (EXIT_SUCCESS);
+				break;
+			case 'm':
+				s.maxpart_report = true;
+				break;
+			case 'P':
+				s.priority = atoi (optarg);
+				break;
+			case 'q':
+				s.quantum = atoi (optarg);
+				break;
+			case 'r':
+				s.rate = atoi (optarg);
+				break;
+			case 's':
+				s.sparse_report = true;
+				break;
+			case 'V':
+				s.verify = true;
+				break;
+			case 'w':
+				table = optarg;
+				break;
+			default:
+				usage (EXIT_FAILURE);
+				break;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		usage (EXIT_FAILURE);
+	}
+
+	s.irlen = atoi (argv[optind]);
+
+	if (s.irlen < 1 || s.irlen > 0x4000000 || s.rate < 8000 || s.duration <= 0) {
+		fprintf (stderr, "Invalid parameter\n");
+		return EXIT_FAILURE;
+	}
+
+	if (s.quantum < Convproc::MINQUANT || s.quantum > Convproc::MAXQUANT || (s.quantum & (s.quantum - 1))) {
+		fprintf (stderr, "Quantum must be a power of two in the range %d..%d\n", Convproc::MINQUANT, Convproc::MAXQUANT);
+		return EXIT_FAILURE;
+	}
+
+#ifdef __linux__
+	if (s.ncores > 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO (&cpuset);
+		for (uint32_t i = 0; i < s.ncores; ++i) {
+			CPU_SET (i, &cpuset);
+		}
+		/* threads created later inherit the affinity */
+		if (sched_setaffinity (0, sizeof (cpuset), &cpuset)) {
+			fprintf (stderr, "Cannot restrict process to %d cores\n", s.ncores);
+			return EXIT_FAILURE;
+		}
+	}
+#endif
+
+	if (s.priority > 0) {
+		struct sched_param parm;
+		parm.sched_priority = s.priority;
+		if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &parm)) {
+			fprintf (stderr, "Cannot use SCHED_FIFO, measurements will not be reliable\n");
+		}
+	}
+
+	/* synthetic IR: exponentially decaying noise, -60dB at the end.
+	 * High frequencies decay faster (4th order lowpass, with the
+	 * cutoff falling from ~20kHz to ~400Hz at 48kHz) */
+	std::vector<float> ir (s.irlen + 4096);
+	uint32_t           seed = 42;
+	float              lpf[4] = { 0, 0, 0, 0 };
+	for (uint32_t i = 0; i < ir.size (); ++i) {
+		const float a = .93f * expf (-3.f * i / s.irlen) + .001f;
+		float       x = noise (seed);
+		for (int k = 0; k < 4; ++k) {
+			x = lpf[k] += a * (x - lpf[k]);
+		}
+		ir[i] = x * expf (-6.9f * i / s.irlen) / sqrtf (a);
+	}
+
+	if (s.sparse_report) {
+		return sparse_report (s, ir);
+	}
+	if (s.maxpart_report) {
+		return maxpart_report (s, ir);
+	}
+	if (s.verify) {
+		return verify_report (s, ir);
+	}
+
+	const float densities[] = { 0.f, 0.25f, 0.5f, 1.f };
+
+	std::vector<Result> results;
+
+	printf ("# IR: %d samples, %d in, %d out, %d paths, quantum %d @ %dHz, %d cores\n",
+	        s.irlen, s.ninp, s.nout, s.npaths, s.quantum, s.rate, s.ncores);
+	printf ("# minpart maxpart density levels late  cpu[us] dsp[%%] max-period[us] level-load\n");
+
+	for (uint32_t minpart = s.quantum; minpart <= Convproc::MAXDIVIS * s.quantum; minpart *= 2) {
+		if (minpart < Convproc::MINPART) {
+			continue;
+		}
+		if (minpart > s.quantum && !s.all_minpart) {
+			break;
+		}
+		for (uint32_t maxpart = minpart; maxpart <= Convproc::MAXPART; maxpart *= 2) {
+			for (size_t d = 0; d < sizeof (densities) / sizeof (float); ++d) {
+				Result r;
+				r.minpart = minpart;
+				r.maxpart = maxpart;
+				r.density = densities[d];
+				r.sparse  = 0;
+				if (!run_layout (s, ir, r)) {
+					continue;
+				}
+				printf ("  %7d %7d %7.2f %6d %4d %8.1f %6.1f %14.1f %10.2f %s\n",
+				        r.minpart, r.maxpart, r.density, r.nlevels, r.nlate,
+				        1e6 * r.cpu, 100 * r.cpu * s.rate / s.quantum, 1e6 * r.t_period, r.load,
+				        r.ok ? "" : "(x)");
+				fflush (stdout);
+				results.push_back (r);
+			}
+			if (maxpart >= s.irlen) {
+				/* larger partitions will not change the layout */
+				break;
+			}
+		}
+	}
+
+	Result const* best = NULL;
+	for (std::vector<Result>::const_iterator i = results.begin (); i != results.end (); ++i) {
+		if (!i->ok || i->minpart != s.quantum) {
+			continue;
+		}
+		if (!best || i->cpu < best->cpu) {
+			best = &(*i);
+		}
+	}
+
+	if (!best) {
+		fprintf (stderr, "No layout is able to keep up.\n");
+		return EXIT_FAILURE;
+	}
+
+	char row[256];
+	snprintf (row, sizeof (row), "%d %d %d %d %d %d %d %d %.2f\n",
+	          s.ninp, s.nout, s.npaths, s.quantum, s.irlen, s.ncores,
+	          best->minpart, best->maxpart, best->density);
+
+	printf ("# ninp nout npaths quantum irlen ncores minpart maxpart density\n%s", row);
+
+	if (table) {
+		FILE* f = fopen (table, "a");
+		if (!f) {
+			fprintf (stderr, "Cannot open '%s' for writing\n", table);
+			return EXIT_FAILURE;
+		}
+		if (ftell (f) == 0) {
+			fprintf (f, "# ninp nout npaths quantum irlen ncores minpart maxpart density\n");
+		}
+		fputs (row, f);
+		fclose (f);
+	}
+
+	return EXIT_SUCCESS;
+}